@@ -1,15 +1,204 @@
-
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include "mpi.h"
 
+/*
+ * Sonda de arranque: colocación de los procesos y matriz de latencias
+ *
+ *   Además del saludo de cada proceso:
+ *     - reúne en el proceso 0 el nombre del procesador de cada rank y su nodo, que
+ *       se obtiene agrupando los procesos con MPI_Comm_split_type(MPI_COMM_TYPE_SHARED)
+ *       y numerando los nodos por su proceso de menor rank;
+ *     - mide con ping-pong la latencia (mensaje de 8 bytes, mediana de la mitad del
+ *       viaje de ida y vuelta) y el ancho de banda (mensaje de --bytes bytes) entre
+ *       cada par de procesos. Todos los procesos recorren los pares en el mismo
+ *       orden con una barrera antes de cada uno, así que nunca hay dos pares
+ *       midiendo a la vez.
+ *
+ *   El resultado se escribe en --output (mapa_procesos.txt por defecto):
+ *     # ranks: P  nodos: K
+ *     rank nodo rank_en_nodo procesador     (una línea por proceso)
+ *     # latencia_us
+ *     matriz PxP
+ *     # ancho_banda_MBs
+ *     matriz PxP
+ *   y el proceso 0 resume las latencias medias dentro de un nodo y entre nodos.
+ *
+ *   Uso: mpiexec ./hellow [--reps=100] [--bytes=1M] [--output=fichero] [--no-matrix]
+ */
+
+#define ETIQUETA 301
+
+static int comparar(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Ping-pong entre los procesos a (inicia) y b. Devuelve, en el proceso a, la mediana
+ * del tiempo de ida de reps viajes de bytes bytes (más 2 de calentamiento).
+ */
+static double ping_pong(int a, int b, int rank, char *buf, int bytes, int reps, double *t)
+{
+    int r;
+    double t1;
+
+    for (r = -2; r < reps; r++) {
+        t1 = MPI_Wtime();
+        if (rank == a) {
+            MPI_Send(buf, bytes, MPI_BYTE, b, ETIQUETA, MPI_COMM_WORLD);
+            MPI_Recv(buf, bytes, MPI_BYTE, b, ETIQUETA, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (r >= 0) t[r] = (MPI_Wtime() - t1)/2;
+        }
+        else {
+            MPI_Recv(buf, bytes, MPI_BYTE, a, ETIQUETA, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Send(buf, bytes, MPI_BYTE, a, ETIQUETA, MPI_COMM_WORLD);
+        }
+    }
+    if (rank != a) return 0.0;
+    qsort(t, reps, sizeof(double), comparar);
+    return t[reps/2];
+}
+
 int main(int argc, char* argv[])
 {
-    int rank, size;
+    int rank, size, i, j, len, reps = 100, bytes = 1 << 20, matriz = 1;
+    int nodo, rank_nodo, lider, nnodos, *nodos = NULL, *ranks_nodo = NULL;
+    char nombre[MPI_MAX_PROCESSOR_NAME], *nombres = NULL, *buf;
+    const char *salida = "mapa_procesos.txt";
+    double *lat, *bw, *lat_total, *bw_total, *t;
+    MPI_Comm comm_nodo, comm_lideres;
 
     MPI_Init(&argc, &argv);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
-    printf("Hello, world, I am %d of %d\n", rank, size);
+
+    for (i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--reps=", 7)) reps = atoi(argv[i]+7);
+        else if (!strncmp(argv[i], "--bytes=", 8)) {
+            /* el contador de MPI_Send es un int: no se admiten mensajes mayores */
+            char *fin;
+            long long v = strtoll(argv[i]+8, &fin, 10);
+            if (*fin == 'K' || *fin == 'k') v = (v > (INT_MAX >> 10)) ? -1 : v << 10;
+            if (*fin == 'M' || *fin == 'm') v = (v > (INT_MAX >> 20)) ? -1 : v << 20;
+            if (v < 1 || v > INT_MAX) {
+                if (0 == rank) fprintf(stderr, "Tamaño de mensaje no válido: %s (máximo %d bytes)\n", argv[i]+8, INT_MAX);
+                MPI_Finalize();
+                return 1;
+            }
+            bytes = (int)v;
+        }
+        else if (!strncmp(argv[i], "--output=", 9)) salida = argv[i]+9;
+        else if (!strcmp(argv[i], "--no-matrix")) matriz = 0;
+    }
+    if (reps < 1) reps = 1;
+
+    MPI_Get_processor_name(nombre, &len);
+    printf("Hello, world, I am %d of %d on %s\n", rank, size, nombre);
+
+    /* Nodos: procesos que comparten memoria; el número de nodo es el orden de su
+       proceso de menor rank (el líder, rank 0 del comunicador del nodo) */
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &comm_nodo);
+    MPI_Comm_rank(comm_nodo, &rank_nodo);
+    lider = (rank_nodo == 0);
+    MPI_Comm_split(MPI_COMM_WORLD, lider ? 0 : MPI_UNDEFINED, rank, &comm_lideres);
+    if (lider) {
+        MPI_Comm_rank(comm_lideres, &nodo);
+        MPI_Comm_size(comm_lideres, &nnodos);
+        MPI_Comm_free(&comm_lideres);
+    }
+    MPI_Bcast(&nodo, 1, MPI_INT, 0, comm_nodo);
+    MPI_Bcast(&nnodos, 1, MPI_INT, 0, comm_nodo);
+
+    if (0 == rank) {
+        nombres = (char*)malloc((size_t)size*MPI_MAX_PROCESSOR_NAME);
+        nodos = (int*)malloc(size*sizeof(int));
+        ranks_nodo = (int*)malloc(size*sizeof(int));
+    }
+    MPI_Gather(nombre, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, nombres, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, MPI_COMM_WORLD);
+    MPI_Gather(&nodo, 1, MPI_INT, nodos, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Gather(&rank_nodo, 1, MPI_INT, ranks_nodo, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    /* Matriz de latencias y anchos de banda: cada par (i,j), i<j, lo mide el proceso i */
+    lat = (double*)calloc((size_t)size*size, sizeof(double));
+    bw = (double*)calloc((size_t)size*size, sizeof(double));
+    lat_total = (double*)calloc((size_t)size*size, sizeof(double));
+    bw_total = (double*)calloc((size_t)size*size, sizeof(double));
+    buf = (char*)calloc(bytes, 1);
+    t = (double*)malloc(reps*sizeof(double));
+
+    for (i = 0; matriz && i < size; i++) {
+        for (j = i+1; j < size; j++) {
+            /* la barrera impide que dos pares disjuntos midan a la vez */
+            MPI_Barrier(MPI_COMM_WORLD);
+            if (rank != i && rank != j) continue;
+            lat[i*size+j] = ping_pong(i, j, rank, buf, 8, reps, t);
+            bw[i*size+j] = ping_pong(i, j, rank, buf, bytes, (reps+9)/10, t);
+            if (rank == i) bw[i*size+j] = bytes/bw[i*size+j]/1e6;
+        }
+    }
+    MPI_Reduce(lat, lat_total, size*size, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(bw, bw_total, size*size, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (0 == rank) {
+        FILE *f = fopen(salida, "w");
+        double suma[2] = {0.0, 0.0};
+        int n[2] = {0, 0};
+
+        /* la matriz es simétrica: se completa el triángulo inferior */
+        for (i = 0; i < size; i++) {
+            for (j = 0; j < i; j++) {
+                lat_total[i*size+j] = lat_total[j*size+i];
+                bw_total[i*size+j] = bw_total[j*size+i];
+            }
+        }
+
+        if (!f) fprintf(stderr, "No se puede abrir %s para escritura\n", salida);
+        else {
+            fprintf(f, "# ranks: %d  nodos: %d\n", size, nnodos);
+            for (i = 0; i < size; i++)
+                fprintf(f, "%d %d %d %s\n", i, nodos[i], ranks_nodo[i], &nombres[(size_t)i*MPI_MAX_PROCESSOR_NAME]);
+            if (matriz) {
+                fprintf(f, "# latencia_us\n");
+                for (i = 0; i < size; i++) {
+                    for (j = 0; j < size; j++) fprintf(f, "%.3f ", lat_total[i*size+j]*1e6);
+                    fprintf(f, "\n");
+                }
+                fprintf(f, "# ancho_banda_MBs (mensajes de %d bytes)\n", bytes);
+                for (i = 0; i < size; i++) {
+                    for (j = 0; j < size; j++) fprintf(f, "%.1f ", bw_total[i*size+j]);
+                    fprintf(f, "\n");
+                }
+            }
+            fclose(f);
+        }
+
+        for (i = 0; matriz && i < size; i++) {
+            for (j = i+1; j < size; j++) {
+                int fuera = (nodos[i] != nodos[j]);
+                suma[fuera] += lat_total[i*size+j];
+                n[fuera]++;
+            }
+        }
+        printf("%d procesos en %d nodos; mapa en %s\n", size, nnodos, salida);
+        if (n[0]) printf("Latencia media dentro del nodo: %.3f us\n", suma[0]/n[0]*1e6);
+        if (n[1]) printf("Latencia media entre nodos: %.3f us\n", suma[1]/n[1]*1e6);
+
+        free(nombres);
+        free(nodos);
+        free(ranks_nodo);
+    }
+
+    free(lat);
+    free(bw);
+    free(lat_total);
+    free(bw_total);
+    free(buf);
+    free(t);
+    MPI_Comm_free(&comm_nodo);
     MPI_Finalize();
 
     return 0;
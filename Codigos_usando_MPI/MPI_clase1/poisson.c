@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include "mpi.h"
+#include "../MPI_clase2/jacobi_kernel.h"
 
 /*
  * Un paso del método de Jacobi para la ecuación de Poisson
@@ -18,7 +19,7 @@
 
 void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
 {
-  int i, j, ld=M+2;
+  int ld=M+2;
   int next, prev;
 
   // Definición de emisores y receptores para comunicación pares-impares
@@ -49,11 +50,7 @@ void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
     MPI_Send(&x[1*ld+1],M,MPI_DOUBLE,prev,0,MPI_COMM_WORLD);
   }
  
-  for (i=1; i<=N; i++) {
-    for (j=1; j<=M; j++) {
-      t[i*ld+j] = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])/4.0;
-    }
-  }
+  jacobi_kernel(1,N,1,M,ld,x,b,t);  /* núcleo compartido (jacobi_kernel.h) */
 }
 
 /*
@@ -4,15 +4,108 @@
  *                         Corporation.  All rights reserved.
  * Copyright (c) 2006      Cisco Systems, Inc.  All rights reserved.
  *
- * Simple ring test program in C.
+ * Ring test program in C, extended into a latency/bandwidth benchmark.
+ */
+
+/*
+ * Banco de pruebas de latencia y ancho de banda en anillo
+ *
+ *   Para cada tamaño de mensaje (potencias de 2 entre --min y --max bytes) se
+ *   hacen --warmup repeticiones sin medir y después --reps repeticiones medidas
+ *   una a una, en cada uno de los modos:
+ *     - blocking: el testigo da una vuelta al anillo con MPI_Send/MPI_Recv, como
+ *       en el ring_c.c original (el proceso 0 envía primero y los demás reciben
+ *       primero). El tiempo de una repetición es el de la vuelta entre P saltos.
+ *     - nonblocking: todos los procesos pasan su mensaje al siguiente a la vez con
+ *       MPI_Irecv/MPI_Isend/MPI_Waitall (desplazamiento del anillo).
+ *     - sendrecv: el mismo desplazamiento con MPI_Sendrecv.
+ *   En los desplazamientos cada repetición empieza tras una barrera y su tiempo es
+ *   el del proceso más lento.
+ *
+ *   Salida (proceso 0): CSV con cabecera o JSON, con el mínimo, los percentiles
+ *   50/90/99 y el máximo de la latencia por salto en microsegundos y el ancho de
+ *   banda (bytes/latencia) en MB/s para la mediana y el mejor caso. La columna
+ *   partition es la de SLURM (SLURM_JOB_PARTITION), para comparar particiones.
+ *
+ *   Uso: mpiexec ./ring [--mode=blocking|nonblocking|sendrecv|all] [--min=8]
+ *          [--max=64M] [--reps=R] [--warmup=5] [--format=csv|json]
+ *   Los tamaños admiten los sufijos K y M. Sin --reps se hacen 1000 repeticiones
+ *   en mensajes pequeños y menos en los grandes (al menos 20).
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "mpi.h"
 
+enum MODOS {MODO_BLOQUEANTE, MODO_NO_BLOQUEANTE, MODO_SENDRECV, NMODOS};
+static const char *nombre_modo[NMODOS] = {"blocking", "nonblocking", "sendrecv"};
+
+/* Tamaño en bytes con sufijo opcional K o M */
+static long leer_bytes(const char *s)
+{
+    char *fin;
+    long v = strtol(s, &fin, 10);
+    if (*fin == 'K' || *fin == 'k') v <<= 10;
+    if (*fin == 'M' || *fin == 'm') v <<= 20;
+    return v;
+}
+
+static int comparar(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Percentil q (0..1) de n valores ya ordenados */
+static double percentil(const double *t, int n, double q)
+{
+    int i = (int)(q*n + 0.999999) - 1;
+    if (i < 0) i = 0;
+    if (i >= n) i = n-1;
+    return t[i];
+}
+
+/* Una repetición en el modo indicado; devuelve el tiempo por salto de este proceso */
+static double repeticion(int modo, char *envio, char *recepcion, int bytes,
+                         int rank, int size, int next, int prev, int tag)
+{
+    MPI_Request reqs[2];
+    double t1 = MPI_Wtime();
+
+    switch (modo) {
+    case MODO_BLOQUEANTE:
+        if (0 == rank) {
+            MPI_Send(envio, bytes, MPI_BYTE, next, tag, MPI_COMM_WORLD);
+            MPI_Recv(recepcion, bytes, MPI_BYTE, prev, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        else {
+            MPI_Recv(recepcion, bytes, MPI_BYTE, prev, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Send(recepcion, bytes, MPI_BYTE, next, tag, MPI_COMM_WORLD);
+        }
+        return (MPI_Wtime() - t1)/size;
+    case MODO_NO_BLOQUEANTE:
+        MPI_Irecv(recepcion, bytes, MPI_BYTE, prev, tag, MPI_COMM_WORLD, &reqs[0]);
+        MPI_Isend(envio, bytes, MPI_BYTE, next, tag, MPI_COMM_WORLD, &reqs[1]);
+        MPI_Waitall(2, reqs, MPI_STATUSES_IGNORE);
+        break;
+    default:
+        MPI_Sendrecv(envio, bytes, MPI_BYTE, next, tag,
+                     recepcion, bytes, MPI_BYTE, prev, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        break;
+    }
+    return MPI_Wtime() - t1;
+}
+
 int main(int argc, char *argv[])
 {
-    int rank, size, next, prev, message, tag = 201;
+    int rank, size, next, prev, tag = 201;
+    int i, r, modo, primero = 1, modos[NMODOS] = {1, 1, 1};
+    int reps = 0, calentamiento = 5, nreps, json = 0;
+    long minimo = 8, maximo = 64L << 20, bytes;
+    double *t, *tmax, lat[5];
+    char *envio, *recepcion;
+    const char *particion = getenv("SLURM_JOB_PARTITION");
 
     /* Start up MPI */
 
@@ -20,6 +113,29 @@ int main(int argc, char *argv[])
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+    for (i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--mode=", 7)) {
+            for (modo = 0; modo < NMODOS; modo++)
+                modos[modo] = !strcmp(argv[i]+7, "all") || !strcmp(argv[i]+7, nombre_modo[modo]);
+        }
+        else if (!strncmp(argv[i], "--min=", 6)) minimo = leer_bytes(argv[i]+6);
+        else if (!strncmp(argv[i], "--max=", 6)) maximo = leer_bytes(argv[i]+6);
+        else if (!strncmp(argv[i], "--reps=", 7)) reps = atoi(argv[i]+7);
+        else if (!strncmp(argv[i], "--warmup=", 9)) calentamiento = atoi(argv[i]+9);
+        else if (!strcmp(argv[i], "--format=json")) json = 1;
+        else if (!strcmp(argv[i], "--format=csv")) json = 0;
+        else if (0 == rank) fprintf(stderr, "Opción desconocida: %s\n", argv[i]);
+    }
+    if (minimo < 1) minimo = 1;
+    if (maximo > 1L << 30) maximo = 1L << 30;  /* el contador de MPI es un int */
+    if (!particion) particion = "-";
+
+    if (size < 2) {
+        if (0 == rank) fprintf(stderr, "El anillo necesita al menos 2 procesos\n");
+        MPI_Finalize();
+        return 1;
+    }
+
     /* Calculate the rank of the next process in the ring.  Use the
        modulus operator so that the last process "wraps around" to
        rank zero. */
@@ -27,56 +143,77 @@ int main(int argc, char *argv[])
     next = (rank + 1) % size;
     prev = (rank + size - 1) % size;
 
-    /* If we are the "master" process (i.e., MPI_COMM_WORLD rank 0),
-       put the number of times to go around the ring in the
-       message. */
-    
-    MPI_Barrier(MPI_COMM_WORLD);
-    double t1 = MPI_Wtime();
-    if (0 == rank) {
-        message = 10;
+    envio = (char*)malloc(maximo);
+    recepcion = (char*)malloc(maximo);
+    memset(envio, rank, maximo);
+    memset(recepcion, 0, maximo);
+    nreps = reps > 0 ? reps : 1000;
+    t = (double*)malloc(nreps*sizeof(double));
+    tmax = (double*)malloc(nreps*sizeof(double));
 
-        printf("Process 0 sending %d to %d, tag %d (%d processes in ring)\n",
-               message, next, tag, size);
-        MPI_Send(&message, 1, MPI_INT, next, tag, MPI_COMM_WORLD);
-        printf("Process 0 sent to %d\n", next);
+    if (0 == rank) {
+        if (json) printf("[\n");
+        else printf("partition,procs,mode,bytes,reps,lat_min_us,lat_p50_us,lat_p90_us,lat_p99_us,"
+                    "lat_max_us,bw_p50_MBs,bw_max_MBs\n");
     }
 
-    /* Pass the message around the ring.  The exit mechanism works as
-       follows: the message (a positive integer) is passed around the
-       ring.  Each time it passes rank 0, it is decremented.  When
-       each processes receives a message containing a 0 value, it
-       passes the message on to the next process and then quits.  By
-       passing the 0 message first, every process gets the 0 message
-       and can quit normally. */
-
-    while (1) {
-        MPI_Recv(&message, 1, MPI_INT, prev, tag, MPI_COMM_WORLD,
-                 MPI_STATUS_IGNORE);
-
-        if (0 == rank) {
-            --message;
-            printf("Process 0 decremented value: %d\n", message);
-        }
-
-        MPI_Send(&message, 1, MPI_INT, next, tag, MPI_COMM_WORLD);
-        if (0 == message) {
-            printf("Process %d exiting\n", rank);
-            break;
+    for (modo = 0; modo < NMODOS; modo++) {
+        if (!modos[modo]) continue;
+        for (bytes = minimo; bytes <= maximo; bytes *= 2) {
+            /* menos repeticiones cuanto mayor es el mensaje: ~1 GB por proceso y tamaño */
+            nreps = reps;
+            if (nreps <= 0) {
+                nreps = (int)((1L << 30)/bytes);
+                if (nreps > 1000) nreps = 1000;
+                if (nreps < 20) nreps = 20;
+                t = (double*)realloc(t, nreps*sizeof(double));
+                tmax = (double*)realloc(tmax, nreps*sizeof(double));
+            }
+
+            for (r = 0; r < calentamiento; r++)
+                repeticion(modo, envio, recepcion, (int)bytes, rank, size, next, prev, tag);
+            MPI_Barrier(MPI_COMM_WORLD);
+            for (r = 0; r < nreps; r++) {
+                /* en los desplazamientos todos los procesos arrancan cada repetición a la
+                   vez, para que el máximo compare tiempos de la misma repetición */
+                if (modo != MODO_BLOQUEANTE) MPI_Barrier(MPI_COMM_WORLD);
+                t[r] = repeticion(modo, envio, recepcion, (int)bytes, rank, size, next, prev, tag);
+            }
+
+            /* en el testigo mide el proceso 0; en los desplazamientos, el más lento */
+            if (modo == MODO_BLOQUEANTE) memcpy(tmax, t, nreps*sizeof(double));
+            else MPI_Reduce(t, tmax, nreps, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+            if (0 != rank) continue;
+            qsort(tmax, nreps, sizeof(double), comparar);
+            lat[0] = tmax[0]*1e6;
+            lat[1] = percentil(tmax, nreps, 0.50)*1e6;
+            lat[2] = percentil(tmax, nreps, 0.90)*1e6;
+            lat[3] = percentil(tmax, nreps, 0.99)*1e6;
+            lat[4] = tmax[nreps-1]*1e6;
+            if (json) {
+                printf("%s  {\"partition\": \"%s\", \"procs\": %d, \"mode\": \"%s\", \"bytes\": %ld, "
+                       "\"reps\": %d, \"lat_min_us\": %.3f, \"lat_p50_us\": %.3f, \"lat_p90_us\": %.3f, "
+                       "\"lat_p99_us\": %.3f, \"lat_max_us\": %.3f, \"bw_p50_MBs\": %.3f, \"bw_max_MBs\": %.3f}",
+                       primero ? "" : ",\n", particion, size, nombre_modo[modo], bytes, nreps,
+                       lat[0], lat[1], lat[2], lat[3], lat[4], bytes/lat[1], bytes/lat[0]);
+            }
+            else {
+                printf("%s,%d,%s,%ld,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                       particion, size, nombre_modo[modo], bytes, nreps,
+                       lat[0], lat[1], lat[2], lat[3], lat[4], bytes/lat[1], bytes/lat[0]);
+            }
+            primero = 0;
+            fflush(stdout);
         }
     }
+    if (0 == rank && json) printf("\n]\n");
 
-    /* The last process does one extra send to process 0, which needs
-       to be received before the program can exit */
+    free(envio);
+    free(recepcion);
+    free(t);
+    free(tmax);
 
-    if (0 == rank) {
-        MPI_Recv(&message, 1, MPI_INT, prev, tag, MPI_COMM_WORLD,
-                 MPI_STATUS_IGNORE);
-        double t2 = MPI_Wtime();
-        printf("Tiempo de cálculo: %f s.\n", t2-t1);
-
-    }
-    
     /* All done */
 
     MPI_Finalize();
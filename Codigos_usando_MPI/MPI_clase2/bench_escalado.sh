@@ -0,0 +1,193 @@
+#!/bin/bash
+#
+# Banco de pruebas de escalado de los solvers de Poisson
+#
+#   Ejecuta un solver con --bench=csv sobre una matriz de mallas y números de
+#   procesos y añade el speedup y la eficiencia de cada ejecución respecto a la de
+#   menos procesos de su grupo, con el tiempo por iteración T (en escalado débil la
+#   malla crece y Jacobi necesita más iteraciones):
+#     - escalado fuerte (-t strong): la malla global es fija, E = T0*P0/(T*P)
+#     - escalado débil (-t weak): los puntos por proceso son fijos y la malla global
+#       crece con P (reparto 2D como MPI_Dims_create), E = T0/T
+#
+#   Uso: ./bench_escalado.sh [opciones] [-- opciones del solver]
+#     -t strong|weak    tipo de escalado (strong)
+#     -p "1 2 4"        números de procesos ("1 2 4")
+#     -m "NxM ..."      mallas globales (strong) o por proceso (weak) ("200x200")
+#     -b programa       solver, debe aceptar --bench=csv (./poisson_top_cartesiana)
+#     -f csv|json       formato de la salida (csv)
+#     -l lanzador       orden para lanzar P procesos, se le añade P ("mpiexec -n")
+#     -o fichero        salida (pantalla)
+#     -s dir            en vez de ejecutar, genera en dir un job array de SLURM por
+#                       cada número de procesos, al estilo de launcher.sh
+#     -c tareas         tareas por nodo en los trabajos de SLURM (1)
+#     -q particion      partición de SLURM (mcpd)
+#     -T tiempo         límite de tiempo de SLURM (5:00)
+#     -r dir            no ejecuta nada: resume los .csv que han dejado en dir los
+#                       trabajos de SLURM generados con -s
+#
+#   Ejemplos:
+#     ./bench_escalado.sh -t strong -p "1 2 4 8" -m "400x400 800x800" -- --halo=overlap
+#     ./bench_escalado.sh -t weak -p "1 4 16" -m "200x200" -s trabajos
+#     ./bench_escalado.sh -t weak -r trabajos -f json
+#
+
+TIPO=strong
+PROCS="1 2 4"
+MALLAS="200x200"
+PROGRAMA=./poisson_top_cartesiana
+FORMATO=csv
+LANZADOR="mpiexec -n"
+SALIDA=
+SLURM=
+RESUMEN=
+TAREAS=1
+PARTICION=mcpd
+TIEMPO=5:00
+COLUMNAS="variant,procs,threads,N,M,iterations,total,setup,sweep,halo,reduction,copy,gather"
+
+while getopts "t:p:m:b:f:l:o:s:c:q:T:r:" opt; do
+  case $opt in
+    t) TIPO=$OPTARG ;;
+    p) PROCS=$OPTARG ;;
+    m) MALLAS=$OPTARG ;;
+    b) PROGRAMA=$OPTARG ;;
+    f) FORMATO=$OPTARG ;;
+    l) LANZADOR=$OPTARG ;;
+    o) SALIDA=$OPTARG ;;
+    s) SLURM=$OPTARG ;;
+    c) TAREAS=$OPTARG ;;
+    q) PARTICION=$OPTARG ;;
+    T) TIEMPO=$OPTARG ;;
+    r) RESUMEN=$OPTARG ;;
+    *) sed -n '3,33p' "$0"; exit 1 ;;
+  esac
+done
+shift $((OPTIND-1))
+OPCIONES="$*"
+set -o pipefail
+
+# El registro de tiempos es la línea que empieza por el nombre del programa (la
+# variante de tiempos_informe); así no se toma como registro ningún otro mensaje
+VARIANTE=$(basename "$PROGRAMA")
+
+if [ "$TIPO" != strong ] && [ "$TIPO" != weak ]; then
+  echo "Tipo de escalado desconocido: $TIPO" >&2
+  exit 1
+fi
+
+# Malla global para P procesos: en escalado débil NxM es el bloque de cada proceso y
+# la malla de procesos es la de MPI_Dims_create (filas x columnas = d x P/d)
+malla_global() {
+  local P=$1 N=${2%x*} M=${2#*x} d=1 i
+  if [ "$TIPO" = strong ]; then
+    echo "$N $M"
+    return
+  fi
+  for ((i=1; i*i<=P; i++)); do
+    if ((P % i == 0)); then d=$i; fi
+  done
+  echo "$((N*d)) $((M*P/d))"
+}
+
+# Añade speedup y eficiencia a los registros CSV de la entrada (sin cabecera). El
+# grupo de una ejecución es su variante y su malla global (strong) o sus puntos por
+# proceso (weak); la referencia es la ejecución con menos procesos del grupo.
+eficiencias() {
+  awk -F, -v OFS=, -v tipo="$TIPO" -v formato="$FORMATO" -v columnas="$COLUMNAS" '
+    function grupo() { return $1 SUBSEP ((tipo == "strong") ? $4 "x" $5 : int($4*$5/$2)) }
+    NR == FNR {
+      g = grupo()
+      if (!(g in p0) || $2 < p0[g]) { p0[g] = $2; t0[g] = $7/$6 }
+      next
+    }
+    FNR == 1 {
+      if (formato == "json") print "["
+      else print columnas ",scaling,speedup,efficiency"
+      n = split(columnas, nombre, ",")
+    }
+    {
+      g = grupo()
+      t = $7/$6
+      speedup = t0[g]/t
+      efic = (tipo == "strong") ? t0[g]*p0[g]/(t*$2) : speedup
+      if (formato == "json") {
+        linea = sprintf("%s  {\"%s\": \"%s\"", (FNR > 1) ? ",\n" : "", nombre[1], $1)
+        for (i=2; i<=n; i++) linea = linea sprintf(", \"%s\": %s", nombre[i], $i)
+        printf "%s, \"scaling\": \"%s\", \"speedup\": %.4f, \"efficiency\": %.4f}", linea, tipo, speedup, efic
+      }
+      else print $0, tipo, sprintf("%.4f", speedup), sprintf("%.4f", efic)
+    }
+    END { if (formato == "json") print "\n]" }
+  ' "$1" "$1"
+}
+
+# Resumen de los resultados de SLURM
+if [ -n "$RESUMEN" ]; then
+  REGISTROS=$(mktemp)
+  cat "$RESUMEN"/*.csv > "$REGISTROS" 2>/dev/null
+  if [ ! -s "$REGISTROS" ]; then
+    echo "No hay resultados en $RESUMEN" >&2
+    rm -f "$REGISTROS"
+    exit 1
+  fi
+  if [ -n "$SALIDA" ]; then eficiencias "$REGISTROS" > "$SALIDA"; else eficiencias "$REGISTROS"; fi
+  rm -f "$REGISTROS"
+  exit 0
+fi
+
+# Generación de los job arrays: uno por número de procesos, con una tarea por malla
+if [ -n "$SLURM" ]; then
+  mkdir -p "$SLURM"
+  read -r -a LISTA <<< "$MALLAS"
+  for P in $PROCS; do
+    NODOS=$(( (P+TAREAS-1)/TAREAS ))
+    GLOBALES=""
+    for MALLA in "${LISTA[@]}"; do
+      read -r N M <<< "$(malla_global "$P" "$MALLA")"
+      GLOBALES="$GLOBALES ${N}x${M}"
+    done
+    GLOBALES=${GLOBALES# }
+    TRABAJO="$SLURM/escalado_P$P.sh"
+    cat > "$TRABAJO" << EOF
+#!/bin/bash
+#SBATCH --nodes=$NODOS
+#SBATCH --ntasks=$P
+#SBATCH --time=$TIEMPO
+#SBATCH --partition=$PARTICION
+#SBATCH --array=0-$(( ${#LISTA[@]}-1 ))
+#SBATCH --output=$SLURM/escalado_P${P}_%a.out
+
+MALLAS=($GLOBALES)
+MALLA=\${MALLAS[\$SLURM_ARRAY_TASK_ID]}
+SALIDA=$SLURM/P${P}_\$SLURM_ARRAY_TASK_ID.txt
+mpiexec $PROGRAMA \${MALLA%x*} \${MALLA#*x} --bench=csv $OPCIONES > \$SALIDA || exit 1
+grep "^$VARIANTE[ ,]" \$SALIDA | tail -n 1 > $SLURM/P${P}_\$SLURM_ARRAY_TASK_ID.csv
+EOF
+    echo "sbatch $TRABAJO"
+  done
+  echo "Tras los trabajos: $0 -t $TIPO -r $SLURM" >&2
+  exit 0
+fi
+
+# Ejecución directa: solo se guarda el registro de las ejecuciones que terminan bien
+REGISTROS=$(mktemp)
+EJECUCION=$(mktemp)
+for MALLA in $MALLAS; do
+  for P in $PROCS; do
+    read -r N M <<< "$(malla_global "$P" "$MALLA")"
+    echo "$P procesos, malla ${N}x${M}" >&2
+    if ! $LANZADOR "$P" "$PROGRAMA" "$N" "$M" --bench=csv $OPCIONES > "$EJECUCION"; then
+      echo "Falló la ejecución con $P procesos y malla ${N}x${M}" >&2
+    elif ! grep "^$VARIANTE[ ,]" "$EJECUCION" | tail -n 1 >> "$REGISTROS"; then
+      echo "La ejecución con $P procesos y malla ${N}x${M} no dejó registro de tiempos" >&2
+    fi
+  done
+done
+if [ ! -s "$REGISTROS" ]; then
+  echo "No hay resultados" >&2
+  rm -f "$REGISTROS" "$EJECUCION"
+  exit 1
+fi
+if [ -n "$SALIDA" ]; then eficiencias "$REGISTROS" > "$SALIDA"; else eficiencias "$REGISTROS"; fi
+rm -f "$REGISTROS" "$EJECUCION"
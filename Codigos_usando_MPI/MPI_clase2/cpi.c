@@ -6,20 +6,131 @@
 
 #include "mpi.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
-double f(double);
+/*
+ * Difusión de n (--bcast=chain|tree|bcast|ibcast|all)
+ *
+ *   - chain: cadena punto a punto, cada proceso recibe del anterior y envía al
+ *     siguiente (la versión original, P-1 latencias)
+ *   - tree: árbol binomial con MPI_Send/MPI_Recv, log2(P) latencias
+ *   - bcast: MPI_Bcast (por defecto)
+ *   - ibcast: MPI_Ibcast y MPI_Wait
+ *   Con all se miden los cuatro métodos (--reps veces cada uno, 100 por defecto);
+ *   todos dejan el mismo n en cada proceso. El tiempo de una difusión es el del proceso
+ *   que más tarda, tras una barrera; se informa del mínimo y de la mediana. Como n es
+ *   un solo entero no tiene sentido trocear el mensaje en una cadena segmentada.
+ */
+enum DIFUSIONES {DIF_CADENA, DIF_ARBOL, DIF_BCAST, DIF_IBCAST, NDIFUSIONES};
+static const char *nombre_difusion[NDIFUSIONES] = {"chain", "tree", "bcast", "ibcast"};
+
+static void difundir(int metodo, long long *n, int myid, int numprocs)
+{
+    int mask, prev, next;
+    MPI_Request req;
+
+    switch (metodo) {
+    case DIF_CADENA:
+        prev = myid ? myid-1 : MPI_PROC_NULL;
+        next = (myid == numprocs-1) ? MPI_PROC_NULL : myid+1;
+        MPI_Recv(n, 1, MPI_LONG_LONG, prev, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Send(n, 1, MPI_LONG_LONG, next, 0, MPI_COMM_WORLD);
+        break;
+    case DIF_ARBOL:
+        /* en el paso mask los procesos que ya tienen n (myid < mask) lo envían a myid+mask */
+        for (mask = 1; mask < numprocs; mask <<= 1) {
+            if (myid < mask && myid+mask < numprocs)
+                MPI_Send(n, 1, MPI_LONG_LONG, myid+mask, 0, MPI_COMM_WORLD);
+            else if (myid >= mask && myid < 2*mask)
+                MPI_Recv(n, 1, MPI_LONG_LONG, myid-mask, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        break;
+    case DIF_BCAST:
+        MPI_Bcast(n, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+        break;
+    default:
+        MPI_Ibcast(n, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD, &req);
+        MPI_Wait(&req, MPI_STATUS_IGNORE);
+        break;
+    }
+}
+
+static int comparar(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Mide reps difusiones de n con el método dado e informa en el proceso 0 */
+static void medir_difusion(int metodo, int reps, long long *n, int myid, int numprocs)
+{
+    int r;
+    double t1, *t = (double*)malloc(reps*sizeof(double));
+
+    for (r = 0; r < reps; r++) {
+        MPI_Barrier(MPI_COMM_WORLD);
+        t1 = MPI_Wtime();
+        difundir(metodo, n, myid, numprocs);
+        t[r] = MPI_Wtime() - t1;
+    }
+    MPI_Reduce(myid ? t : MPI_IN_PLACE, t, reps, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (myid == 0) {
+        qsort(t, reps, sizeof(double), comparar);
+        printf("distribution %-6s procs %d reps %d: min %.3f us, median %.3f us\n",
+               nombre_difusion[metodo], numprocs, reps, t[0]*1e6, t[reps/2]*1e6);
+    }
+    free(t);
+}
 
-double f(double a)
+static inline double f(double a)
 {
     return (4.0 / (1.0 + a * a));
 }
 
+/*
+ * Suma de f en los rectángulos [ini, ini+cnt) de anchura h
+ *
+ *   Los puntos se recorren en bloques de BLOQUE. Dentro de un bloque se acumulan
+ *   CARRILES sumas independientes, que el compilador evalúa con instrucciones SIMD
+ *   (no puede reordenar una única suma en coma flotante), y x se calcula desde el
+ *   inicio del bloque con un índice de 32 bits. Las sumas de los bloques se
+ *   acumulan con compensación de Kahan, así que el error no crece con n.
+ */
+#define CARRILES 8
+#define BLOQUE 4096
+
+static double suma_rectangulos(long long ini, long long cnt, double h)
+{
+    double suma = 0.0, c = 0.0, y, t, x0, parcial[CARRILES];
+    long long k0;
+    int k, l, nb;
+
+    for (k0 = 0; k0 < cnt; k0 += BLOQUE) {
+        nb = (cnt-k0 < BLOQUE) ? (int)(cnt-k0) : BLOQUE;
+        x0 = h * ((double)(ini+k0) + 0.5);
+        for (l = 0; l < CARRILES; l++) parcial[l] = 0.0;
+        for (k = 0; k + CARRILES <= nb; k += CARRILES)
+            for (l = 0; l < CARRILES; l++)
+                parcial[l] += f(x0 + h * (double)(k+l));
+        for (; k < nb; k++) parcial[0] += f(x0 + h * (double)k);
+        for (l = 1; l < CARRILES; l++) parcial[0] += parcial[l];
+
+        y = parcial[0] - c;
+        t = suma + y;
+        c = (t - suma) - y;
+        suma = t;
+    }
+    return suma;
+}
+
 int main(int argc, char *argv[])
 {
-    int n, myid, numprocs, i;
+    int myid, numprocs, i, metodo = DIF_BCAST, todos = 0, reps = 100;
+    long long n = 10000, ini, cnt;  /* default # of rectangles */
     double PI25DT = 3.141592653589793238462643;
-    double mypi, pi, h, sum, x;
+    double mypi, pi, h, sum;
     double startwtime = 0.0, endwtime;
     int namelen;
     char processor_name[MPI_MAX_PROCESSOR_NAME];
@@ -29,39 +140,58 @@ int main(int argc, char *argv[])
     MPI_Comm_rank(MPI_COMM_WORLD, &myid);
     MPI_Get_processor_name(processor_name, &namelen);
 
+    for (i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--bcast=", 8)) {
+            todos = !strcmp(argv[i]+8, "all");
+            for (metodo = 0; metodo < NDIFUSIONES; metodo++)
+                if (!strcmp(argv[i]+8, nombre_difusion[metodo])) break;
+            if (metodo == NDIFUSIONES && !todos) {
+                if (myid == 0) fprintf(stderr, "Método de difusión desconocido: %s\n", argv[i]+8);
+                MPI_Finalize();
+                return 1;
+            }
+        }
+        else if (!strncmp(argv[i], "--reps=", 7)) {
+            if ((reps = atoi(argv[i]+7)) < 1) reps = 1;
+        }
+        else if (strncmp(argv[i], "--", 2)) {  /* número de rectángulos */
+            char *fin;
+            n = strtoll(argv[i], &fin, 10);
+            if (*fin || n < 1) {
+                if (myid == 0) fprintf(stderr, "Número de rectángulos no válido: %s\n", argv[i]);
+                MPI_Finalize();
+                return 1;
+            }
+        }
+        else {
+            if (myid == 0) fprintf(stderr, "Opción desconocida: %s\n", argv[i]);
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
     fprintf(stdout, "Process %d of %d is on %s\n", myid, numprocs, processor_name);
     fflush(stdout);
 
 
-    if (myid == 0){
-        startwtime = MPI_Wtime();
-        n = 10000;  /* default # of rectangles */
-    }
-
-    // Difusión de la variable "n" punto a punto (pares-impares)
-    int prev, next;
-    if (!myid) prev = MPI_PROC_NULL;
-    else prev = myid-1;
-    if (myid == numprocs-1) next = MPI_PROC_NULL;
-    else next = myid+1;
-
+    if (myid == 0) startwtime = MPI_Wtime();
+    else n = 0;  /* lo recibe del proceso 0 */
 
-    if (!myid){
-        MPI_Send(&n,1,MPI_INT,next,0,MPI_COMM_WORLD);
+    // Difusión de la variable "n" con el método elegido (ver difundir)
+    if (todos) {
+        for (i = 0; i < NDIFUSIONES; i++)
+            medir_difusion(i, reps, &n, myid, numprocs);
+        if (myid == 0) startwtime = MPI_Wtime();  /* sin contar las mediciones */
     }
-    else{
-        MPI_Recv(&n,1,MPI_INT,prev,0,MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        MPI_Send(&n,1,MPI_INT,next,0,MPI_COMM_WORLD);
-    }
-    //MPI_Bcast(&n, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    else
+        medir_difusion(metodo, 1, &n, myid, numprocs);
 
+    /* Reparto por bloques contiguos: los n%numprocs primeros procesos hacen uno más */
     h = 1.0 / (double) n;
-    sum = 0.0;
-    /* A slightly better approach starts from large i and works back */
-    for (i = myid + 1; i <= n; i += numprocs) {
-        x = h * ((double) i - 0.5);
-        sum += f(x);
-    }
+    cnt = n / numprocs;
+    ini = myid * cnt + ((myid < n % numprocs) ? myid : n % numprocs);
+    if (myid < n % numprocs) cnt++;
+    sum = suma_rectangulos(ini, cnt, h);
     mypi = h * sum;
 
     MPI_Reduce(&mypi, &pi, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
@@ -0,0 +1,273 @@
+#ifndef JACOBI_KERNEL_H
+#define JACOBI_KERNEL_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * OpenMP
+ *
+ *   Compilando con -fopenmp los núcleos reparten las filas entre los hilos con un
+ *   reparto estático (modo híbrido MPI+OpenMP); sin OpenMP las directivas
+ *   desaparecen. Los rectángulos pequeños (p. ej. los bordes del modo solapado) se
+ *   recorren con un solo hilo para no pagar el coste de abrir la región paralela.
+ */
+#ifdef _OPENMP
+#include <omp.h>
+#define OMP_TEXTO(d) #d
+#define OMP(d) _Pragma(OMP_TEXTO(omp d))
+#else
+#define OMP(d)
+#endif
+#define OMP_UMBRAL 16384  /* puntos a partir de los cuales se usan los hilos */
+#define OMP_SI(i0,i1,j0,j1) ((long)((i1)-(i0)+1)*((j1)-(j0)+1) >= OMP_UMBRAL)
+
+/*
+ * Reserva de la malla con filas alineadas
+ *
+ *   Con ld = ld_alineado(M) cada fila ocupa un número entero de líneas de caché y,
+ *   con la malla reservada por malla_reservar, el primer punto interior de cada
+ *   fila (columna 1) empieza en una línea de caché. La malla se devuelve a cero y
+ *   se libera con malla_liberar.
+ *
+ *   La puesta a cero es el primer toque de la memoria: cada hilo escribe las filas
+ *   interiores que luego recorrerá en los núcleos (mismo reparto estático de las
+ *   filas 1..N), así que sus páginas quedan en el nodo NUMA de ese hilo.
+ */
+#define MALLA_ALINEACION 64  /* bytes de una línea de caché */
+#define MALLA_DOUBLES (MALLA_ALINEACION/(int)sizeof(double))
+
+static inline int ld_alineado(int M)
+{
+  return ((M+2+MALLA_DOUBLES-1)/MALLA_DOUBLES)*MALLA_DOUBLES;
+}
+
+static inline double *malla_reservar(int N,int ld)
+{
+  size_t tam = ((size_t)(N+2)*ld + MALLA_DOUBLES)*sizeof(double);
+  tam = (tam+MALLA_ALINEACION-1)/MALLA_ALINEACION*MALLA_ALINEACION;  /* aligned_alloc exige un múltiplo */
+  double *p = (double*)aligned_alloc(MALLA_ALINEACION, tam);
+  double *x = p + MALLA_DOUBLES-1;
+  int i;
+
+  memset(p, 0, (MALLA_DOUBLES-1+ld)*sizeof(double));  /* relleno inicial y fila 0 */
+  OMP(parallel for schedule(static))
+  for (i=1; i<=N; i++) memset(&x[i*ld], 0, ld*sizeof(double));
+  memset(&x[(N+1)*ld], 0, (ld+1)*sizeof(double));     /* fila N+1 y relleno final */
+  return x;
+}
+
+static inline void malla_liberar(double *x)
+{
+  free(x - (MALLA_DOUBLES-1));
+}
+
+/*
+ * Núcleo del paso de Jacobi, compartido por la versión serie y las versiones MPI
+ *
+ *   Actualiza con el stencil de 5 puntos el rectángulo de puntos [i0,i1]x[j0,j1]
+ *   de una malla con leading dimension ld (rango vacío si i0>i1 o j0>j1): escribe
+ *   t a partir de x y b y, en el mismo recorrido, acumula la suma de (x-t)^2 de
+ *   esos puntos, que se devuelve para el criterio de parada. Así la malla pasa
+ *   por la caché una sola vez por iteración.
+ *
+ *   Hay una versión escalar y, en x86 con GCC o Clang, versiones AVX2 y AVX-512
+ *   que se eligen en tiempo de ejecución según la CPU (ver jacobi_simd_nivel). Todas
+ *   suman los vecinos en el mismo orden y multiplican por 0.25, así que t es idéntico
+ *   bit a bit; solo cambia el orden de la suma de (x-t)^2.
+ */
+static inline double jacobi_kernel_escalar(int i0,int i1,int j0,int j1,int ld,const double *x,const double *b,double *t)
+{
+  int i, j;
+  double d, s = 0.0;
+  for (i=i0; i<=i1; i++) {
+    for (j=j0; j<=j1; j++) {
+      t[i*ld+j] = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])*0.25;
+      d = x[i*ld+j]-t[i*ld+j];
+      s += d*d;
+    }
+  }
+  return s;
+}
+
+#if !defined(JACOBI_SIN_SIMD) && (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define JACOBI_SIMD 1
+#include <immintrin.h>
+
+__attribute__((target("avx2,fma")))
+static double jacobi_kernel_avx2(int i0,int i1,int j0,int j1,int ld,const double *x,const double *b,double *t)
+{
+  int i, j;
+  double s = 0.0, parcial[4];
+  __m256d v, dif, cuarto = _mm256_set1_pd(0.25), acum = _mm256_setzero_pd();
+  for (i=i0; i<=i1; i++) {
+    for (j=j0; j+3<=j1; j+=4) {
+      v = _mm256_add_pd(_mm256_loadu_pd(&b[i*ld+j]), _mm256_loadu_pd(&x[(i+1)*ld+j]));
+      v = _mm256_add_pd(v, _mm256_loadu_pd(&x[(i-1)*ld+j]));
+      v = _mm256_add_pd(v, _mm256_loadu_pd(&x[i*ld+(j+1)]));
+      v = _mm256_add_pd(v, _mm256_loadu_pd(&x[i*ld+(j-1)]));
+      v = _mm256_mul_pd(v, cuarto);
+      _mm256_storeu_pd(&t[i*ld+j], v);
+      dif = _mm256_sub_pd(_mm256_loadu_pd(&x[i*ld+j]), v);
+      acum = _mm256_fmadd_pd(dif, dif, acum);
+    }
+    /* resto de la fila, menos puntos que el ancho del vector */
+    s += jacobi_kernel_escalar(i,i,j,j1,ld,x,b,t);
+  }
+  _mm256_storeu_pd(parcial, acum);
+  return s + (parcial[0]+parcial[1]) + (parcial[2]+parcial[3]);
+}
+
+__attribute__((target("avx512f")))
+static double jacobi_kernel_avx512(int i0,int i1,int j0,int j1,int ld,const double *x,const double *b,double *t)
+{
+  int i, j;
+  double s = 0.0;
+  __m512d v, dif, cuarto = _mm512_set1_pd(0.25), acum = _mm512_setzero_pd();
+  for (i=i0; i<=i1; i++) {
+    for (j=j0; j+7<=j1; j+=8) {
+      v = _mm512_add_pd(_mm512_loadu_pd(&b[i*ld+j]), _mm512_loadu_pd(&x[(i+1)*ld+j]));
+      v = _mm512_add_pd(v, _mm512_loadu_pd(&x[(i-1)*ld+j]));
+      v = _mm512_add_pd(v, _mm512_loadu_pd(&x[i*ld+(j+1)]));
+      v = _mm512_add_pd(v, _mm512_loadu_pd(&x[i*ld+(j-1)]));
+      v = _mm512_mul_pd(v, cuarto);
+      _mm512_storeu_pd(&t[i*ld+j], v);
+      dif = _mm512_sub_pd(_mm512_loadu_pd(&x[i*ld+j]), v);
+      acum = _mm512_fmadd_pd(dif, dif, acum);
+    }
+    /* resto de la fila, menos puntos que el ancho del vector */
+    s += jacobi_kernel_escalar(i,i,j,j1,ld,x,b,t);
+  }
+  return s + _mm512_reduce_add_pd(acum);
+}
+
+/*
+ * Nivel SIMD a usar: 2 = AVX-512, 1 = AVX2, 0 = escalar. Por defecto el mayor que
+ * admite la CPU; la variable de entorno JACOBI_SIMD=escalar|avx2|avx512 lo limita
+ * (útil para comparar rendimientos).
+ */
+static inline int jacobi_simd_nivel(void)
+{
+  int nivel = 0;
+  const char *e = getenv("JACOBI_SIMD");
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) nivel = 1;
+  if (__builtin_cpu_supports("avx512f")) nivel = 2;
+  if (e && !strcmp(e, "escalar")) nivel = 0;
+  else if (e && !strcmp(e, "avx2") && nivel > 1) nivel = 1;
+  return nivel;
+}
+#endif
+
+static inline double jacobi_kernel(int i0,int i1,int j0,int j1,int ld,const double *x,const double *b,double *t)
+{
+  int i;
+  double s = 0.0;
+#ifdef JACOBI_SIMD
+  static int simd = -1;
+  int nivel;
+  if (simd < 0) simd = jacobi_simd_nivel();
+  nivel = simd;
+#endif
+  /* cada hilo recorre un bloque de filas con la versión elegida */
+  OMP(parallel for reduction(+:s) schedule(static) if(OMP_SI(i0,i1,j0,j1)))
+  for (i=i0; i<=i1; i++) {
+#ifdef JACOBI_SIMD
+    if (nivel == 2) s += jacobi_kernel_avx512(i,i,j0,j1,ld,x,b,t);
+    else if (nivel == 1) s += jacobi_kernel_avx2(i,i,j0,j1,ld,x,b,t);
+    else
+#endif
+    s += jacobi_kernel_escalar(i,i,j0,j1,ld,x,b,t);
+  }
+  return s;
+}
+
+/*
+ * Jacobi ponderado sobre el rectángulo [i0,i1]x[j0,j1]: t = x + w*(J(x)-x), donde
+ * J(x) es el paso de Jacobi. Es el suavizador del multigrid (w = 4/5 en 2D).
+ */
+static inline void jacobi_kernel_pond(int i0,int i1,int j0,int j1,int ld,double w,const double *x,const double *b,double *t)
+{
+  int i, j;
+  double jac;
+  OMP(parallel for private(j,jac) schedule(static) if(OMP_SI(i0,i1,j0,j1)))
+  for (i=i0; i<=i1; i++) {
+    for (j=j0; j<=j1; j++) {
+      jac = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])*0.25;
+      t[i*ld+j] = x[i*ld+j] + w*(jac-x[i*ld+j]);
+    }
+  }
+}
+
+/*
+ * Residuo r = b - A x sobre el rectángulo [i0,i1]x[j0,j1], con A el operador de
+ * 5 puntos escalado como en el resto del código (4 en la diagonal, -1 en los vecinos).
+ */
+static inline void residuo_kernel(int i0,int i1,int j0,int j1,int ld,const double *x,const double *b,double *r)
+{
+  int i, j;
+  OMP(parallel for private(j) schedule(static) if(OMP_SI(i0,i1,j0,j1)))
+  for (i=i0; i<=i1; i++) {
+    for (j=j0; j<=j1; j++) {
+      r[i*ld+j] = b[i*ld+j] - (4.0*x[i*ld+j] - x[(i+1)*ld+j] - x[(i-1)*ld+j] - x[i*ld+(j+1)] - x[i*ld+(j-1)]);
+    }
+  }
+}
+
+/*
+ * Aplica el operador de 5 puntos sobre el rectángulo [i0,i1]x[j0,j1]: y = A x.
+ * A es simétrica y definida positiva, por lo que sirve también para el gradiente
+ * conjugado.
+ */
+static inline void operador_kernel(int i0,int i1,int j0,int j1,int ld,const double *x,double *y)
+{
+  int i, j;
+  OMP(parallel for private(j) schedule(static) if(OMP_SI(i0,i1,j0,j1)))
+  for (i=i0; i<=i1; i++) {
+    for (j=j0; j<=j1; j++) {
+      y[i*ld+j] = 4.0*x[i*ld+j] - x[(i+1)*ld+j] - x[(i-1)*ld+j] - x[i*ld+(j+1)] - x[i*ld+(j-1)];
+    }
+  }
+}
+
+/*
+ * Semibarrido de SOR rojo-negro sobre el rectángulo [i0,i1]x[j0,j1]
+ *
+ *   Actualiza sobre x (en el sitio) solo los puntos con (i+j)%2 == color, donde
+ *   color ya incluye la paridad del desplazamiento global del bloque, de forma que
+ *   la coloración es la misma en todos los procesos. Un punto de un color solo
+ *   depende de puntos del otro color, así que el orden del recorrido no importa.
+ *   Devuelve la suma de los cuadrados de las correcciones aplicadas.
+ */
+static inline double sor_kernel(int i0,int i1,int j0,int j1,int ld,int color,double omega,double *x,const double *b)
+{
+  int i, j;
+  double gs, d, s = 0.0;
+  OMP(parallel for private(j,gs,d) reduction(+:s) schedule(static) if(OMP_SI(i0,i1,j0,j1)))
+  for (i=i0; i<=i1; i++) {
+    for (j=j0+(i+j0+color)%2; j<=j1; j+=2) {
+      gs = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])*0.25;
+      d = omega*(gs-x[i*ld+j]);
+      x[i*ld+j] += d;
+      s += d*d;
+    }
+  }
+  return s;
+}
+
+/*
+ * Factor de relajación óptimo de SOR para el Laplaciano de 5 puntos en una malla
+ * de NxM puntos interiores con condiciones de Dirichlet: a partir del radio
+ * espectral de Jacobi rho = (cos(pi/(N+1))+cos(pi/(M+1)))/2,
+ * omega = 2/(1+sqrt(1-rho^2)).
+ */
+static inline double sor_omega_optimo(int N,int M)
+{
+  double pi = 3.141592653589793;
+  double rho = (cos(pi/(N+1)) + cos(pi/(M+1)))/2.0;
+  return 2.0/(1.0+sqrt(1.0-rho*rho));
+}
+
+#endif
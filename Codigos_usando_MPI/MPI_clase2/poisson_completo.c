@@ -1,24 +1,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "mpi.h"
+#include "jacobi_kernel.h"
+#include "poisson_io.h"
+#include "poisson_tiempos.h"
+
+/* Métodos de resolución */
+enum METODOS {METODO_JACOBI, METODO_SOR};
 
 /*
- * Un paso del método de Jacobi para la ecuación de Poisson
- *
- *   Argumentos:
- *     - N,M: dimensiones de la malla
- *     - Entrada: x es el vector de la iteración anterior, b es la parte derecha del sistema
- *     - Salida: t es el nuevo vector
- *
- *   Se asume que x,b,t son de dimensión (N+2)*(M+2), se recorren solo los puntos interiores
- *   de la malla, y en los bordes están almacenadas las condiciones de frontera (por defecto 0).
+ * Reparto por bloques de N elementos entre P procesos: el proceso r recibe *n
+ * elementos a partir del *ini (base 0). Las N%P primeras partes llevan un
+ * elemento más, así que vale para cualquier N y P.
  */
+void reparto_bloques(int N,int P,int r,int *n,int *ini)
+{
+  int q = N/P, resto = N%P;
+  *n = q + (r < resto);
+  *ini = r*q + (r < resto ? r : resto);
+}
 
-
-void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
+/*
+ * Intercambio de las filas fantasma con los vecinos anterior y siguiente
+ * (orden pares-impares)
+ *
+ *   El orden depende solo de la paridad del rango; en los extremos el vecino que
+ *   falta es MPI_PROC_NULL y sus envíos y recepciones no hacen nada. Así no hay
+ *   interbloqueo con ningún número de procesos (antes el último proceso recibía
+ *   siempre primero, y con 3 procesos se bloqueaba junto al proceso 1).
+ */
+void intercambio_halo(int N,int M,double *x, int rank, int size)
 {
-  int i, j, ld=M+2;
+  int ld=M+2;
   int next, prev;
 
   // Definición de emisores y receptores para comunicación pares-impares
@@ -27,15 +42,7 @@ void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
   if (rank == size-1) next = MPI_PROC_NULL;
   else next = rank+1;
 
-  if (!rank){
-    MPI_Send(&x[N*ld],ld,MPI_DOUBLE,next,0,MPI_COMM_WORLD);
-    MPI_Recv(&x[(N+1)*ld],ld,MPI_DOUBLE,next,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-  }
-  else if(rank == size-1){
-    MPI_Recv(&x[0*ld],ld,MPI_DOUBLE,prev,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-    MPI_Send(&x[1*ld],ld,MPI_DOUBLE,prev,0,MPI_COMM_WORLD);
-  }
-  else if (rank%2 == 0){
+  if (rank%2 == 0){
     //Los pares envían primero al siguiente y al anterior, y luego, reciben del anterior y del siguiente
     MPI_Send(&x[N*ld],ld,MPI_DOUBLE,next,0,MPI_COMM_WORLD);
     MPI_Send(&x[1*ld],ld,MPI_DOUBLE,prev,0,MPI_COMM_WORLD);
@@ -48,12 +55,46 @@ void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
     MPI_Send(&x[N*ld],ld,MPI_DOUBLE,next,0,MPI_COMM_WORLD);
     MPI_Send(&x[1*ld],ld,MPI_DOUBLE,prev,0,MPI_COMM_WORLD);
   }
- 
-  for (i=1; i<=N; i++) {
-    for (j=1; j<=M; j++) {
-      t[i*ld+j] = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])/4.0;
-    }
+}
+
+/*
+ * Un paso del método de Jacobi para la ecuación de Poisson
+ *
+ *   Argumentos:
+ *     - N,M: dimensiones de la malla
+ *     - Entrada: x es el vector de la iteración anterior, b es la parte derecha del sistema
+ *     - Salida: t es el nuevo vector; se devuelve la suma local de (x-t)^2
+ *
+ *   Se asume que x,b,t son de dimensión (N+2)*(M+2), se recorren solo los puntos interiores
+ *   de la malla, y en los bordes están almacenadas las condiciones de frontera (por defecto 0).
+ */
+double jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
+{
+  double s;
+  BYTES(FASE_HALO, sizeof(double)*(M+2)*((rank > 0) + (rank < size-1)));
+  CRONO(FASE_HALO, intercambio_halo(N,M,x,rank,size));
+  CRONO(FASE_BARRIDO, s = jacobi_kernel(1,N,1,M,M+2,x,b,t));
+  return s;
+}
+
+/*
+ * Un paso de SOR rojo-negro para la ecuación de Poisson
+ *
+ *   Actualiza x en el sitio: primero los puntos rojos y después los negros, con un
+ *   intercambio de halo antes de cada color para que cada semibarrido vea los valores
+ *   del otro color ya actualizados en los vecinos. desp es la paridad de la primera
+ *   fila global del bloque. Devuelve la suma local de ||x_{k}-x_{k+1}||^2.
+ */
+double sor_step(int N,int M,double *x,double *b, int rank, int size, double omega, int desp)
+{
+  int color;
+  double s = 0.0;
+  for (color=0; color<2; color++) {
+    BYTES(FASE_HALO, sizeof(double)*(M+2)*((rank > 0) + (rank < size-1)));
+    CRONO(FASE_HALO, intercambio_halo(N,M,x,rank,size));
+    CRONO(FASE_BARRIDO, s += sor_kernel(1,N,1,M,M+2,(color+desp)%2,omega,x,b));
   }
+  return s;
 }
 
 /*
@@ -71,31 +112,39 @@ void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
  *
  *   Suponemos que las condiciones de contorno son igual a 0 en toda la
  *   frontera del dominio.
+ *
+ *   Con metodo == METODO_SOR se usa SOR rojo-negro con factor de relajación omega
+ *   en lugar de Jacobi. fila0 es la primera fila global (base 0) del bloque.
+ *
+ *   Los tiempos del barrido, el halo, la reducción y la copia final se acumulan
+ *   en poisson_tiempos.h.
  */
-void jacobi_poisson(int N,int M,double *x,double *b, int rank, int size)
+void jacobi_poisson(int N,int M,double *x,double *b, int rank, int size, int fila0, int metodo, double omega)
 {
   int i, j, k, ld=M+2, conv, maxit=10000;
-  double *t, local_s, total_s, tol=1e-6;
+  double *t, *xk, *xn, *tmp, local_s, total_s, tol=1e-6;
 
-  t = (double*)calloc((N+2)*(M+2),sizeof(double));
+  t = malla_reservar(N,ld);
+  xk = x;
+  xn = t;
 
   k = 0;
   conv = 0;
 
   while (!conv && k<maxit) {
 
-    /* calcula siguiente vector */
-    jacobi_step(N,M,x,b,t,rank,size);
-
-    /* criterio de parada: ||x_{k}-x_{k+1}||<tol */
-    local_s = 0.0;
-    for (i=1; i<=N; i++) {
-      for (j=1; j<=M; j++) {
-        local_s += (x[i*ld+j]-t[i*ld+j])*(x[i*ld+j]-t[i*ld+j]);
-      }
+    /* calcula siguiente vector y, en el mismo recorrido, el criterio de parada: ||x_{k}-x_{k+1}||<tol */
+    if (metodo == METODO_SOR) {
+      local_s = sor_step(N,M,xk,b,rank,size,omega,fila0%2);
+    }
+    else {
+      local_s = jacobi_step(N,M,xk,b,xn,rank,size);
+      /* x y t intercambian sus papeles, sin copiar la malla */
+      tmp = xk; xk = xn; xn = tmp;
     }
 
-    MPI_Allreduce(&local_s, &total_s, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    BYTES(FASE_REDUCCION, sizeof(double));
+    CRONO(FASE_REDUCCION, MPI_Allreduce(&local_s, &total_s, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD));
 
     conv = (sqrt(total_s)<tol);
 
@@ -105,45 +154,82 @@ void jacobi_poisson(int N,int M,double *x,double *b, int rank, int size)
 
     /* siguiente iteración */
     k = k+1;
-    for (i=1; i<=N; i++) {
-      for (j=1; j<=M; j++) {
-        x[i*ld+j] = t[i*ld+j];
-      }
-    }
 
   }
 
-  free(t);
+  /* la solución queda en xk; si es el vector auxiliar se copia a x una sola vez */
+  CRONO(FASE_COPIA,
+    if (xk != x) {
+      for (i=1; i<=N; i++) {
+        for (j=1; j<=M; j++) {
+          x[i*ld+j] = xk[i*ld+j];
+        }
+      }
+    }
+  );
+
+  malla_liberar(t);
 }
 
 int main(int argc, char **argv)
 {
-  int i, j, N=40, M=50, ld;
-  double *x, *b, *sol, h=0.01, f=1.5;
-  int rank, size;
+  int i, j, N=40, M=50, ld, npos=0, metodo=METODO_JACOBI;
+  double *x, *b, *sol, h=0.01, f=1.5, omega=0.0;
+  const char *salida = NULL;
+  int rank, size, n, fila0, *cuentas, *desps, resumen = 0;
 
 
-  MPI_Init(&argc, &argv);
+  /* Modo híbrido: solo el hilo maestro llama a MPI, fuera de las regiones paralelas
+     de los núcleos (jacobi_kernel.h), así que basta con MPI_THREAD_FUNNELED */
+  int provisto;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provisto);
+  tiempos_iniciar();
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-
-  /* Extracción de argumentos */
-  if (argc > 1) { /* El usuario ha indicado el valor de N */
-    if ((N = atoi(argv[1])) < 0) N = 40;
+#ifdef _OPENMP
+  if (!rank) {
+    printf("Procesos MPI: %d, hilos OpenMP por proceso: %d\n", size, omp_get_max_threads());
+    if (provisto < MPI_THREAD_FUNNELED) fprintf(stderr, "Aviso: MPI no garantiza MPI_THREAD_FUNNELED\n");
   }
-  if (argc > 2) { /* El usuario ha indicado el valor de M */
-    if ((M = atoi(argv[2])) < 0) M = 1;
+#endif
+
+
+  /* Extracción de argumentos: N y M posicionales, opciones con "--" */
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "--method=sor")) metodo = METODO_SOR;
+    else if (!strcmp(argv[i], "--method=jacobi")) metodo = METODO_JACOBI;
+    else if (!strncmp(argv[i], "--omega=", 8)) omega = atof(argv[i]+8);  /* "auto" -> 0 */
+    else if (!strncmp(argv[i], "--output=", 9)) salida = argv[i]+9;
+    else if (!strcmp(argv[i], "--timing")) resumen = 1;  /* resumen de tiempos por fase al final */
+    else if (npos == 0) { /* El usuario ha indicado el valor de N */
+      if ((N = atoi(argv[i])) < 0) N = 40;
+      npos++;
+    }
+    else if (npos == 1) { /* El usuario ha indicado el valor de M */
+      if ((M = atoi(argv[i])) < 0) M = 1;
+      npos++;
+    }
   }
+  if (metodo == METODO_SOR && omega <= 0.0) omega = sor_omega_optimo(N,M);
+  if (metodo == METODO_SOR && !rank) printf("SOR rojo-negro con omega = %g\n", omega);
   ld = M+2;  /* leading dimension */
 
-  int n = N / size;
+  if (N < size) {
+    if (!rank) fprintf(stderr, "La malla tiene menos filas (%d) que procesos (%d)\n", N, size);
+    MPI_Finalize();
+    return 1;
+  }
+
+  /* Reparto de filas por bloques; el resto se reparte entre los primeros procesos */
+  reparto_bloques(N,size,rank,&n,&fila0);
 
   /* Reserva de memoria */
-  x = (double*)calloc((n+2)*(M+2),sizeof(double));
-  b = (double*)calloc((n+2)*(M+2),sizeof(double));
+  x = malla_reservar(n,ld);
+  b = malla_reservar(n,ld);
 
-  /* Inicializar datos */
+  /* Inicializar datos (con el mismo reparto de filas entre hilos que los núcleos) */
+  OMP(parallel for private(j) schedule(static))
   for (i=1; i<=n; i++) {
     for (j=1; j<=M; j++) {
       b[i*ld+j] = h*h*f;  /* suponemos que la función f es constante en todo el dominio */
@@ -151,14 +237,34 @@ int main(int argc, char **argv)
   }
 
   /* Resolución del sistema por el método de Jacobi */
-  jacobi_poisson(n,M,x,b,rank,size);
+  FASE(FASE_BARRIDO);
+  jacobi_poisson(n,M,x,b,rank,size,fila0,metodo,omega);
+  FASE(FASE_FUERA);
+
+  /* Con --output=fichero cada proceso escribe su bloque en un fichero binario con
+     MPI-IO (ver poisson_io.h), sin reunir la malla en el máster */
+  if (salida) {
+    CRONO(FASE_RECOGIDA, escribir_solucion(salida,MPI_COMM_WORLD,N,M,n,M,fila0,0,x));
+    if (resumen) tiempos_resumen(MPI_COMM_WORLD);
+    malla_liberar(x);
+    malla_liberar(b);
+    MPI_Finalize();
+    return 0;
+  }
 
   /* Imprimir solución (solo para comprobación, eliminar en el caso de problemas grandes) */
 
   sol = (double*)calloc((N)*(M+2),sizeof(double));
+  cuentas = (int*)malloc(size*sizeof(int));
+  desps = (int*)malloc(size*sizeof(int));
+  for (i=0; i<size; i++) {
+    reparto_bloques(N,size,i,&cuentas[i],&desps[i]);
+    cuentas[i] *= ld;
+    desps[i] *= ld;
+  }
 
-  /* Comunicación colectiva para pasar la solución al máster */
-  MPI_Gather( &x[ld] , n*ld , MPI_DOUBLE , sol , n*ld , MPI_DOUBLE , 0 , MPI_COMM_WORLD);
+  /* Comunicación colectiva para pasar la solución al máster (bloques de tamaño distinto) */
+  CRONO(FASE_RECOGIDA, MPI_Gatherv( &x[ld] , n*ld , MPI_DOUBLE , sol , cuentas , desps , MPI_DOUBLE , 0 , MPI_COMM_WORLD));
 
   if (!rank){
     for (i=0; i<N; i++) {
@@ -168,11 +274,13 @@ int main(int argc, char **argv)
       printf("\n");
     }
   }
-  
+  if (resumen) tiempos_resumen(MPI_COMM_WORLD);
 
-  free(x);
-  free(b);
+  malla_liberar(x);
+  malla_liberar(b);
   free(sol);
+  free(cuentas);
+  free(desps);
 
   MPI_Finalize();
   return 0;
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include "mpi.h"
+#include "jacobi_kernel.h"
 
 /*
  * Un paso del método de Jacobi para la ecuación de Poisson
@@ -9,16 +10,17 @@
  *   Argumentos:
  *     - N,M: dimensiones de la malla
  *     - Entrada: x es el vector de la iteración anterior, b es la parte derecha del sistema
- *     - Salida: t es el nuevo vector
+ *     - Salida: t es el nuevo vector; devuelve la suma local de (x-t)^2 para el
+ *       criterio de parada (el núcleo compartido de jacobi_kernel.h calcula las dos cosas)
  *
  *   Se asume que x,b,t son de dimensión (N+2)*(M+2), se recorren solo los puntos interiores
  *   de la malla, y en los bordes están almacenadas las condiciones de frontera (por defecto 0).
  */
 
 
-void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
+double jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
 {
-  int i, j, ld=M+2;
+  int ld=M+2;
   int next, prev;
 
   // Definición de emisores y receptores para comunicación pares-impares
@@ -41,11 +43,7 @@ void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
     MPI_Send(&x[1*ld],ld,MPI_DOUBLE,prev,0,MPI_COMM_WORLD);
   }
  
-  for (i=1; i<=N; i++) {
-    for (j=1; j<=M; j++) {
-      t[i*ld+j] = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])/4.0;
-    }
-  }
+  return jacobi_kernel(1,N,1,M,ld,x,b,t);
 }
 
 /*
@@ -76,16 +74,10 @@ void jacobi_poisson(int N,int M,double *x,double *b, int rank, int size)
 
   while (!conv && k<maxit) {
 
-    /* calcula siguiente vector */
-    jacobi_step(N,M,x,b,t,rank,size);
+    /* calcula siguiente vector y la parte local de ||x_{k}-x_{k+1}|| */
+    local_s = jacobi_step(N,M,x,b,t,rank,size);
 
     /* criterio de parada: ||x_{k}-x_{k+1}||<tol */
-    local_s = 0.0;
-    for (i=1; i<=N; i++) {
-      for (j=1; j<=M; j++) {
-        local_s += (x[i*ld+j]-t[i*ld+j])*(x[i*ld+j]-t[i*ld+j]);
-      }
-    }
 
     MPI_Allreduce(&local_s, &total_s, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
 
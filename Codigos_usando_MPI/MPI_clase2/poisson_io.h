@@ -0,0 +1,197 @@
+#ifndef POISSON_IO_H
+#define POISSON_IO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpi.h"
+
+/*
+ * Salida binaria de la solución con MPI-IO, compartida por las versiones MPI
+ *
+ *   Formato del fichero: una cabecera con dos int (N y M, dimensiones de la malla
+ *   global sin el contorno) seguida de los N*M valores double de la solución por
+ *   filas. No hace falta reunir la malla en el máster: cada proceso escribe su
+ *   bloque directamente en su sitio del fichero.
+ */
+#define POISSON_CABECERA (2*(MPI_Offset)sizeof(int))
+
+/*
+ * Tipos derivados de un bloque: vista es el bloque nxm dentro de la malla global
+ * NgxMg (a partir de la fila fila0 y la columna col0, base 0) y bloque es el mismo
+ * bloque en memoria, dentro del vector local de (n+2)*(m+2) con halo.
+ */
+static inline void tipos_bloque(int Ng, int Mg, int n, int m, int fila0, int col0,
+                                MPI_Datatype *vista, MPI_Datatype *bloque)
+{
+  int tam[2], sub[2], ini[2];
+
+  tam[0] = Ng;    tam[1] = Mg;
+  sub[0] = n;     sub[1] = m;
+  ini[0] = fila0; ini[1] = col0;
+  MPI_Type_create_subarray(2, tam, sub, ini, MPI_ORDER_C, MPI_DOUBLE, vista);
+  MPI_Type_commit(vista);
+
+  tam[0] = n+2; tam[1] = m+2;
+  ini[0] = 1;   ini[1] = 1;
+  MPI_Type_create_subarray(2, tam, sub, ini, MPI_ORDER_C, MPI_DOUBLE, bloque);
+  MPI_Type_commit(bloque);
+}
+
+/*
+ * Escritura colectiva de la solución
+ *
+ *   x es el bloque local de nxm puntos interiores con su halo, es decir, de
+ *   dimensión (n+2)*(m+2). fila0 y col0 son los índices globales (base 0) de su
+ *   primera fila y columna en la malla global NgxMg. La vista del fichero es un
+ *   subarray de la malla global y el tipo en memoria un subarray que salta el halo,
+ *   así que una sola llamada a MPI_File_write_all escribe el bloque.
+ *   Devuelve el código de error de MPI (MPI_SUCCESS si todo fue bien).
+ */
+static inline int escribir_solucion(const char *fichero, MPI_Comm comm, int Ng, int Mg,
+                                    int n, int m, int fila0, int col0, const double *x)
+{
+  int rank, err, cabecera[2] = {Ng, Mg};
+  MPI_File fh;
+  MPI_Datatype vista, bloque;
+
+  MPI_Comm_rank(comm, &rank);
+  err = MPI_File_open(comm, fichero, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+  if (err != MPI_SUCCESS) {
+    if (!rank) fprintf(stderr, "No se puede abrir %s para escritura\n", fichero);
+    return err;
+  }
+  MPI_File_set_size(fh, 0);
+
+  /* cabecera: solo la escribe el proceso 0 */
+  MPI_File_write_at_all(fh, 0, cabecera, rank ? 0 : 2, MPI_INT, MPI_STATUS_IGNORE);
+
+  tipos_bloque(Ng, Mg, n, m, fila0, col0, &vista, &bloque);
+  MPI_File_set_view(fh, POISSON_CABECERA, MPI_DOUBLE, vista, "native", MPI_INFO_NULL);
+  err = MPI_File_write_all(fh, x, 1, bloque, MPI_STATUS_IGNORE);
+
+  MPI_File_close(&fh);
+  MPI_Type_free(&vista);
+  MPI_Type_free(&bloque);
+  return err;
+}
+
+/*
+ * Checkpoints del estado del solver
+ *
+ *   Formato: una cabecera de 4 double (N, M, iteraciones completadas y último error
+ *   conocido) seguida de la malla global como en escribir_solucion. El bloque se
+ *   copia a un buffer propio y se escribe con MPI_File_iwrite_all, de modo que la
+ *   escritura avanza mientras el solver sigue iterando; se completa en el checkpoint
+ *   siguiente o al liberar. Se escribe en "fichero.tmp" y, una vez cerrado, el
+ *   proceso 0 lo renombra a "fichero": el checkpoint anterior sigue siendo válido
+ *   hasta que el nuevo está entero en disco.
+ */
+#define CHECKPOINT_CABECERA (4*(MPI_Offset)sizeof(double))
+
+typedef struct {
+  char fichero[1024], temporal[1028];
+  MPI_Comm comm;
+  int rank, tam, Ng, Mg;
+  MPI_Datatype vista, bloque;
+  double *copia;
+  MPI_File fh;
+  MPI_Request req;
+  int pendiente;
+} checkpoint;
+
+static inline void checkpoint_crear(checkpoint *c, const char *fichero, MPI_Comm comm, int Ng, int Mg,
+                                    int n, int m, int fila0, int col0)
+{
+  snprintf(c->fichero, sizeof(c->fichero), "%s", fichero);
+  snprintf(c->temporal, sizeof(c->temporal), "%s.tmp", c->fichero);
+  c->comm = comm;
+  MPI_Comm_rank(comm, &c->rank);
+  c->tam = (n+2)*(m+2);
+  c->Ng = Ng;
+  c->Mg = Mg;
+  c->copia = (double*)malloc(c->tam*sizeof(double));
+  tipos_bloque(Ng, Mg, n, m, fila0, col0, &c->vista, &c->bloque);
+  c->req = MPI_REQUEST_NULL;
+  c->pendiente = 0;
+}
+
+/* Espera a que termine la escritura en curso, cierra el fichero y lo hace visible */
+static inline void checkpoint_completar(checkpoint *c)
+{
+  if (!c->pendiente) return;
+  MPI_Wait(&c->req, MPI_STATUS_IGNORE);
+  MPI_File_close(&c->fh);
+  if (!c->rank && rename(c->temporal, c->fichero))
+    fprintf(stderr, "No se puede renombrar %s\n", c->temporal);
+  c->pendiente = 0;
+}
+
+/* Deja avanzar la escritura en curso; se llama una vez por iteración */
+static inline void checkpoint_progreso(checkpoint *c)
+{
+  int hecho;
+  if (c->pendiente) MPI_Test(&c->req, &hecho, MPI_STATUS_IGNORE);
+}
+
+/* Lanza la escritura del bloque x tras k iteraciones completadas */
+static inline void checkpoint_escribir(checkpoint *c, const double *x, int k, double error)
+{
+  double cabecera[4];
+
+  checkpoint_completar(c);
+  memcpy(c->copia, x, c->tam*sizeof(double));
+
+  cabecera[0] = c->Ng;
+  cabecera[1] = c->Mg;
+  cabecera[2] = k;
+  cabecera[3] = error;
+
+  MPI_File_open(c->comm, c->temporal, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &c->fh);
+  MPI_File_set_size(c->fh, 0);
+  /* cabecera: solo la escribe el proceso 0 */
+  MPI_File_write_at_all(c->fh, 0, cabecera, c->rank ? 0 : 4, MPI_DOUBLE, MPI_STATUS_IGNORE);
+  MPI_File_set_view(c->fh, CHECKPOINT_CABECERA, MPI_DOUBLE, c->vista, "native", MPI_INFO_NULL);
+  MPI_File_iwrite_all(c->fh, c->copia, 1, c->bloque, &c->req);
+  c->pendiente = 1;
+}
+
+/* Completa la escritura pendiente y libera los tipos y el buffer */
+static inline void checkpoint_liberar(checkpoint *c)
+{
+  checkpoint_completar(c);
+  MPI_Type_free(&c->vista);
+  MPI_Type_free(&c->bloque);
+  free(c->copia);
+}
+
+/*
+ * Lectura de un checkpoint en el bloque x (con halo, ver escribir_solucion).
+ * Devuelve 0 y las iteraciones completadas y el último error en *k y *error, o -1
+ * si el fichero no existe o no corresponde a una malla NgxMg.
+ */
+static inline int checkpoint_leer(const char *fichero, MPI_Comm comm, int Ng, int Mg,
+                                  int n, int m, int fila0, int col0, double *x, int *k, double *error)
+{
+  double cabecera[4];
+  MPI_File fh;
+  MPI_Datatype vista, bloque;
+
+  if (MPI_File_open(comm, fichero, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) return -1;
+  MPI_File_read_at_all(fh, 0, cabecera, 4, MPI_DOUBLE, MPI_STATUS_IGNORE);
+  if ((int)cabecera[0] != Ng || (int)cabecera[1] != Mg) {
+    MPI_File_close(&fh);
+    return -1;
+  }
+  tipos_bloque(Ng, Mg, n, m, fila0, col0, &vista, &bloque);
+  MPI_File_set_view(fh, CHECKPOINT_CABECERA, MPI_DOUBLE, vista, "native", MPI_INFO_NULL);
+  MPI_File_read_all(fh, x, 1, bloque, MPI_STATUS_IGNORE);
+  MPI_File_close(&fh);
+  MPI_Type_free(&vista);
+  MPI_Type_free(&bloque);
+  *k = (int)cabecera[2];
+  *error = cabecera[3];
+  return 0;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include "jacobi_kernel.h"
 
 /*
  * Un paso del método de Jacobi para la ecuación de Poisson
@@ -8,19 +9,16 @@
  *   Argumentos:
  *     - N,M: dimensiones de la malla
  *     - Entrada: x es el vector de la iteración anterior, b es la parte derecha del sistema
- *     - Salida: t es el nuevo vector
+ *     - Salida: t es el nuevo vector; se devuelve la suma local de (x-t)^2
  *
- *   Se asume que x,b,t son de dimensión (N+2)*(M+2), se recorren solo los puntos interiores
+ *   Se asume que x,b,t son de dimensión (N+2)*ld, con ld = ld_alineado(M) para que las
+ *   filas empiecen en una línea de caché; se recorren solo los puntos interiores
  *   de la malla, y en los bordes están almacenadas las condiciones de frontera (por defecto 0).
  */
-void jacobi_step(int N,int M,double *x,double *b,double *t)
+double jacobi_step(int N,int M,double *x,double *b,double *t)
 {
-  int i, j, ld=M+2;
-  for (i=1; i<=N; i++) {
-    for (j=1; j<=M; j++) {
-      t[i*ld+j] = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])/4.0;
-    }
-  }
+  int ld=ld_alineado(M);
+  return jacobi_kernel(1,N,1,M,ld,x,b,t);
 }
 
 /*
@@ -41,40 +39,39 @@ void jacobi_step(int N,int M,double *x,double *b,double *t)
  */
 void jacobi_poisson(int N,int M,double *x,double *b)
 {
-  int i, j, k, ld=M+2, conv, maxit=10000;
-  double *t, s, tol=1e-6;
+  int i, j, k, ld=ld_alineado(M), conv, maxit=10000;
+  double *t, *xk, *xn, *tmp, s, tol=1e-6;
 
-  t = (double*)calloc((N+2)*(M+2),sizeof(double));
+  t = malla_reservar(N,ld);
+  xk = x;
+  xn = t;
 
   k = 0;
   conv = 0;
 
   while (!conv && k<maxit) {
 
-    /* calcula siguiente vector */
-    jacobi_step(N,M,x,b,t);
-
-    /* criterio de parada: ||x_{k}-x_{k+1}||<tol */
-    s = 0.0;
-    for (i=1; i<=N; i++) {
-      for (j=1; j<=M; j++) {
-        s += (x[i*ld+j]-t[i*ld+j])*(x[i*ld+j]-t[i*ld+j]);
-      }
-    }
+    /* calcula siguiente vector y, en el mismo recorrido, el criterio de parada: ||x_{k}-x_{k+1}||<tol */
+    s = jacobi_step(N,M,xk,b,xn);
     conv = (sqrt(s)<tol);
     printf("Error en iteración %d: %g\n", k, sqrt(s));
 
-    /* siguiente iteración */
+    /* siguiente iteración: x y t intercambian sus papeles, sin copiar la malla */
     k = k+1;
+    tmp = xk; xk = xn; xn = tmp;
+
+  }
+
+  /* la solución queda en xk; si es el vector auxiliar se copia a x una sola vez */
+  if (xk != x) {
     for (i=1; i<=N; i++) {
       for (j=1; j<=M; j++) {
-        x[i*ld+j] = t[i*ld+j];
+        x[i*ld+j] = xk[i*ld+j];
       }
     }
-
   }
 
-  free(t);
+  malla_liberar(t);
 }
 
 int main(int argc, char **argv)
@@ -89,11 +86,11 @@ int main(int argc, char **argv)
   if (argc > 2) { /* El usuario ha indicado el valor de M */
     if ((M = atoi(argv[2])) < 0) M = 1;
   }
-  ld = M+2;  /* leading dimension */
+  ld = ld_alineado(M);  /* leading dimension, con relleno hasta una línea de caché */
 
   /* Reserva de memoria */
-  x = (double*)calloc((N+2)*(M+2),sizeof(double));
-  b = (double*)calloc((N+2)*(M+2),sizeof(double));
+  x = malla_reservar(N,ld);
+  b = malla_reservar(N,ld);
 
   /* Inicializar datos */
   for (i=1; i<=N; i++) {
@@ -113,8 +110,8 @@ int main(int argc, char **argv)
     printf("\n");
   }
 
-  free(x);
-  free(b);
+  malla_liberar(x);
+  malla_liberar(b);
 
   return 0;
 }
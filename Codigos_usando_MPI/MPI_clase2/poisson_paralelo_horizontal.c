@@ -1,7 +1,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "mpi.h"
+#include "jacobi_kernel.h"
+#include "poisson_io.h"
+#include "poisson_tiempos.h"
+
+/*
+ * Reparto por bloques de M elementos entre P procesos: el proceso r recibe *m
+ * elementos a partir del *ini (base 0). Las M%P primeras partes llevan un
+ * elemento más, así que vale para cualquier M y P.
+ */
+void reparto_bloques(int M,int P,int r,int *m,int *ini)
+{
+  int q = M/P, resto = M%P;
+  *m = q + (r < resto);
+  *ini = r*q + (r < resto ? r : resto);
+}
+
+/*
+ * Plan de comunicación del halo
+ *
+ *   Se construye una sola vez por resolución (en jacobi_poisson): vecinos anterior
+ *   y siguiente, el tipo columna ya registrado y las peticiones persistentes de las
+ *   dos columnas fantasma. Hay un juego de peticiones para cada uno de los vectores
+ *   x y t, que intercambian sus papeles en cada iteración; "actual" indica cuál hace
+ *   de x. En cada iteración solo queda MPI_Startall/MPI_Waitall.
+ */
+typedef struct {
+  int prev, next;
+  MPI_Datatype columna;
+  MPI_Request reqs[2][4];
+  int actual;
+} halo_plan;
+
+void halo_plan_crear(halo_plan *plan,int N,int M,double *x,double *t, int rank, int size)
+{
+  int c, ld = M+2;
+  double *v[2] = {x, t};
+
+  // Definición de emisores y receptores
+  if (!rank) plan->prev = MPI_PROC_NULL;
+  else plan->prev = rank-1;
+  if (rank == size-1) plan->next = MPI_PROC_NULL;
+  else plan->next = rank+1;
+
+  MPI_Type_vector( N+2 , 1 , ld , MPI_DOUBLE , &plan->columna);
+  MPI_Type_commit( &plan->columna);
+
+  for (c=0; c<2; c++) {
+    x = v[c];
+    MPI_Recv_init(&x[0*ld+0],1,plan->columna,plan->prev,0,MPI_COMM_WORLD,&plan->reqs[c][0]);
+    MPI_Recv_init(&x[0*ld+M+1],1,plan->columna,plan->next,0,MPI_COMM_WORLD,&plan->reqs[c][1]);
+    MPI_Send_init(&x[0*ld+M],1,plan->columna,plan->next,0,MPI_COMM_WORLD,&plan->reqs[c][2]);
+    MPI_Send_init(&x[0*ld+1],1,plan->columna,plan->prev,0,MPI_COMM_WORLD,&plan->reqs[c][3]);
+  }
+  plan->actual = 0;
+}
+
+void halo_plan_liberar(halo_plan *plan)
+{
+  int c, i;
+  for (c=0; c<2; c++)
+    for (i=0; i<4; i++) MPI_Request_free(&plan->reqs[c][i]);
+  MPI_Type_free( &plan->columna);
+}
 
 /*
  * Un paso del método de Jacobi para la ecuación de Poisson
@@ -9,46 +73,25 @@
  *   Argumentos:
  *     - N,M: dimensiones de la malla
  *     - Entrada: x es el vector de la iteración anterior, b es la parte derecha del sistema
- *     - Salida: t es el nuevo vector
+ *     - Salida: t es el nuevo vector; se devuelve la suma local de (x-t)^2
+ *     - plan: plan del halo; plan->actual debe corresponder al vector x
  *
  *   Se asume que x,b,t son de dimensión (N+2)*(M+2), se recorren solo los puntos interiores
  *   de la malla, y en los bordes están almacenadas las condiciones de frontera (por defecto 0).
  */
-
-
-void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
+double jacobi_step(int N,int M,double *x,double *b,double *t, halo_plan *plan)
 {
-  int i, j, ld=M+2;
-  int next, prev;
+  int ld=M+2;
+  double s;
 
-  // Definición de emisores y receptores para comunicación pares-impares
-  if (!rank) prev = MPI_PROC_NULL;
-  else prev = rank-1;
-  if (rank == size-1) next = MPI_PROC_NULL;
-  else next = rank+1;
+  BYTES(FASE_HALO, sizeof(double)*(N+2)*((plan->prev != MPI_PROC_NULL) + (plan->next != MPI_PROC_NULL)));
+  CRONO(FASE_HALO,
+    MPI_Startall(4, plan->reqs[plan->actual]);
+    MPI_Waitall(4, plan->reqs[plan->actual], MPI_STATUSES_IGNORE);
+  );
 
-  MPI_Datatype columna;
-  MPI_Type_vector( N+2 , 1 , ld , MPI_DOUBLE , &columna);
-  MPI_Type_commit( &columna);
-
-  if (rank%2 == 0){
-    MPI_Send(&x[0*ld+M],1,columna,next,0,MPI_COMM_WORLD);
-    MPI_Send(&x[0*ld+1],1,columna,prev,0,MPI_COMM_WORLD);
-    MPI_Recv(&x[0*ld+0],1,columna,prev,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-    MPI_Recv(&x[0*ld+M+1],1,columna,next,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-  }
-  else{
-    MPI_Recv(&x[0*ld+0],1,columna,prev,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-    MPI_Recv(&x[0*ld+M+1],1,columna,next,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-    MPI_Send(&x[0*ld+M],1,columna,next,0,MPI_COMM_WORLD);
-    MPI_Send(&x[0*ld+1],1,columna,prev,0,MPI_COMM_WORLD);
-  }
- 
-  for (i=1; i<=N; i++) {
-    for (j=1; j<=M; j++) {
-      t[i*ld+j] = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])/4.0;
-    }
-  }
+  CRONO(FASE_BARRIDO, s = jacobi_kernel(1,N,1,M,ld,x,b,t));
+  return s;
 }
 
 /*
@@ -66,31 +109,32 @@ void jacobi_step(int N,int M,double *x,double *b,double *t, int rank, int size)
  *
  *   Suponemos que las condiciones de contorno son igual a 0 en toda la
  *   frontera del dominio.
+ *
+ *   Los tiempos del barrido, el halo, la reducción y la copia final se acumulan
+ *   en poisson_tiempos.h.
  */
 void jacobi_poisson(int N,int M,double *x,double *b, int rank, int size)
 {
   int i, j, k, ld=M+2, conv, maxit=10000;
-  double *t, local_s, total_s, tol=1e-6;
+  double *t, *xk, *xn, *tmp, local_s, total_s, tol=1e-6;
 
-  t = (double*)calloc((N+2)*(M+2),sizeof(double));
+  t = malla_reservar(N,ld);
+  xk = x;
+  xn = t;
 
   k = 0;
   conv = 0;
 
+  halo_plan plan;
+  halo_plan_crear(&plan,N,M,x,t,rank,size);
+
   while (!conv && k<maxit) {
 
-    /* calcula siguiente vector */
-    jacobi_step(N,M,x,b,t,rank,size);
+    /* calcula siguiente vector y, en el mismo recorrido, el criterio de parada: ||x_{k}-x_{k+1}||<tol */
+    local_s = jacobi_step(N,M,xk,b,xn,&plan);
 
-    /* criterio de parada: ||x_{k}-x_{k+1}||<tol */
-    local_s = 0.0;
-    for (i=1; i<=N; i++) {
-      for (j=1; j<=M; j++) {
-        local_s += (x[i*ld+j]-t[i*ld+j])*(x[i*ld+j]-t[i*ld+j]);
-      }
-    }
-
-    MPI_Allreduce(&local_s, &total_s, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    BYTES(FASE_REDUCCION, sizeof(double));
+    CRONO(FASE_REDUCCION, MPI_Allreduce(&local_s, &total_s, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD));
 
     conv = (sqrt(total_s)<tol);
 
@@ -98,48 +142,84 @@ void jacobi_poisson(int N,int M,double *x,double *b, int rank, int size)
       printf("Error en iteración %d: %g\n", k, sqrt(total_s));
     }
 
-    /* siguiente iteración */
+    /* siguiente iteración: x y t intercambian sus papeles, sin copiar la malla */
     k = k+1;
-    for (i=1; i<=N; i++) {
-      for (j=1; j<=M; j++) {
-        x[i*ld+j] = t[i*ld+j];
-      }
-    }
+    tmp = xk; xk = xn; xn = tmp;
+    plan.actual = 1-plan.actual;
 
   }
 
-  free(t);
+  /* la solución queda en xk; si es el vector auxiliar se copia a x una sola vez */
+  CRONO(FASE_COPIA,
+    if (xk != x) {
+      for (i=1; i<=N; i++) {
+        for (j=1; j<=M; j++) {
+          x[i*ld+j] = xk[i*ld+j];
+        }
+      }
+    }
+  );
+
+  halo_plan_liberar(&plan);
+  malla_liberar(t);
 }
 
 int main(int argc, char **argv)
 {
-  int i, j, N=40, M=40, ld;
+  int i, j, N=40, M=40, ld, npos=0;
   double *x, *b, *sol, h=0.01, f=1.5;
-  int rank, size;
+  const char *salida = NULL;
+  int rank, size, resumen = 0;
 
 
-  MPI_Init(&argc, &argv);
+  /* Modo híbrido: solo el hilo maestro llama a MPI, fuera de las regiones paralelas
+     de los núcleos (jacobi_kernel.h), así que basta con MPI_THREAD_FUNNELED */
+  int provisto;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provisto);
+  tiempos_iniciar();
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-
-  /* Extracción de argumentos */
-  if (argc > 1) { /* El usuario ha indicado el valor de N */
-    if ((N = atoi(argv[1])) < 0) N = 40;
+#ifdef _OPENMP
+  if (!rank) {
+    printf("Procesos MPI: %d, hilos OpenMP por proceso: %d\n", size, omp_get_max_threads());
+    if (provisto < MPI_THREAD_FUNNELED) fprintf(stderr, "Aviso: MPI no garantiza MPI_THREAD_FUNNELED\n");
   }
-  if (argc > 2) { /* El usuario ha indicado el valor de M */
-    if ((M = atoi(argv[2])) < 0) M = 1;
+#endif
+
+
+  /* Extracción de argumentos: N y M posicionales, opciones con "--" */
+  for (i=1; i<argc; i++) {
+    if (!strncmp(argv[i], "--output=", 9)) salida = argv[i]+9;
+    else if (!strcmp(argv[i], "--timing")) resumen = 1;  /* resumen de tiempos por fase al final */
+    else if (npos == 0) { /* El usuario ha indicado el valor de N */
+      if ((N = atoi(argv[i])) < 0) N = 40;
+      npos++;
+    }
+    else if (npos == 1) { /* El usuario ha indicado el valor de M */
+      if ((M = atoi(argv[i])) < 0) M = 1;
+      npos++;
+    }
   }
   
-  int m = M / size;
+  if (M < size) {
+    if (!rank) fprintf(stderr, "La malla tiene menos columnas (%d) que procesos (%d)\n", M, size);
+    MPI_Finalize();
+    return 1;
+  }
+
+  /* Reparto de columnas por bloques; el resto se reparte entre los primeros procesos */
+  int m, col0, *cuentas, *desps;
+  reparto_bloques(M,size,rank,&m,&col0);
 
   ld = m+2;  /* leading dimension */
 
   /* Reserva de memoria */
-  x = (double*)calloc((N+2)*(m+2),sizeof(double));
-  b = (double*)calloc((N+2)*(m+2),sizeof(double));
+  x = malla_reservar(N,ld);
+  b = malla_reservar(N,ld);
 
-  /* Inicializar datos */
+  /* Inicializar datos (con el mismo reparto de filas entre hilos que los núcleos) */
+  OMP(parallel for private(j) schedule(static))
   for (i=1; i<=N; i++) {
     for (j=1; j<=m; j++) {
       b[i*ld+j] = h*h*f;  /* suponemos que la función f es constante en todo el dominio */
@@ -153,7 +233,21 @@ int main(int argc, char **argv)
   MPI_Type_commit( &columna);
 
   /* Resolución del sistema por el método de Jacobi */
+  FASE(FASE_BARRIDO);
   jacobi_poisson(N,m,x,b,rank,size);
+  FASE(FASE_FUERA);
+
+  /* Con --output=fichero cada proceso escribe sus columnas en un fichero binario con
+     MPI-IO (ver poisson_io.h), sin reunir la malla en el máster */
+  if (salida) {
+    CRONO(FASE_RECOGIDA, escribir_solucion(salida,MPI_COMM_WORLD,N,M,N,m,0,col0,x));
+    if (resumen) tiempos_resumen(MPI_COMM_WORLD);
+    MPI_Type_free( &columna);
+    malla_liberar(x);
+    malla_liberar(b);
+    MPI_Finalize();
+    return 0;
+  }
 
   /* Imprimir solución (solo para comprobación, eliminar en el caso de problemas grandes) */
 
@@ -174,8 +268,13 @@ int main(int argc, char **argv)
 
   sol = (double*)calloc((N+2)*(M),sizeof(double));
 
-  // /* Comunicación colectiva para pasar la solución al máster */
-  MPI_Gather( &x[0*ld+1] , m , columna_resized , sol , m , columna_sol_resized , 0 , MPI_COMM_WORLD);
+  cuentas = (int*)malloc(size*sizeof(int));
+  desps = (int*)malloc(size*sizeof(int));
+  for (i=0; i<size; i++) reparto_bloques(M,size,i,&cuentas[i],&desps[i]);
+
+  /* Comunicación colectiva para pasar la solución al máster: cada proceso aporta sus
+     m columnas, que van a partir de su primera columna global (extent de una columna = 1 double) */
+  CRONO(FASE_RECOGIDA, MPI_Gatherv( &x[0*ld+1] , m , columna_resized , sol , cuentas , desps , columna_sol_resized , 0 , MPI_COMM_WORLD));
 
   ld = M;
   if (!rank){
@@ -186,14 +285,17 @@ int main(int argc, char **argv)
       printf("\n");
     }
   }
-  
+  if (resumen) tiempos_resumen(MPI_COMM_WORLD);
+
   MPI_Type_free( &columna);
   MPI_Type_free( &columna_resized);
   MPI_Type_free( &columna_sol);
   MPI_Type_free( &columna_sol_resized);
-  free(x);
-  free(b);
+  malla_liberar(x);
+  malla_liberar(b);
   free(sol);
+  free(cuentas);
+  free(desps);
 
   MPI_Finalize();
   return 0;
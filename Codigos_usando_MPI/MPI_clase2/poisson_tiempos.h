@@ -0,0 +1,163 @@
+#ifndef POISSON_TIEMPOS_H
+#define POISSON_TIEMPOS_H
+
+#include <stdio.h>
+#include "mpi.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Tiempos y volumen de comunicación por fases de la resolución
+ *
+ *   En cada momento el proceso está en una fase (fase_actual) y el tiempo
+ *   transcurrido, medido con MPI_Wtime, se carga a ella. FASE(f) pasa a la fase f y
+ *   devuelve la anterior; CRONO(f, sentencias) ejecuta las sentencias en la fase f y
+ *   vuelve a la de antes. Las fases anidadas se descuentan de la exterior: un halo
+ *   dentro de un ciclo de multigrid cuenta como halo y no como barrido. BYTES(f, n)
+ *   suma n bytes enviados a la fase f.
+ *
+ *   Compilando con -DSIN_TIEMPOS las macros se quedan en las sentencias y los
+ *   contadores a cero, sin ninguna llamada a MPI_Wtime.
+ */
+enum FASES {FASE_PREPARACION, FASE_BARRIDO, FASE_HALO, FASE_REDUCCION, FASE_COPIA, FASE_RECOGIDA,
+            NFASES, FASE_FUERA = NFASES};
+
+static const char *nombre_fase[NFASES] = {"setup", "sweep", "halo", "reduction", "copy", "gather"};
+static double tiempo_fase[NFASES+1], bytes_fase[NFASES+1];
+
+#ifndef SIN_TIEMPOS
+
+static int fase_actual = FASE_FUERA;
+static double t_fase;
+
+static inline int fase_cambiar(int f)
+{
+  double t = MPI_Wtime();
+  int previa = fase_actual;
+  tiempo_fase[fase_actual] += t - t_fase;
+  t_fase = t;
+  fase_actual = f;
+  return previa;
+}
+
+#define CRONO(f, ...) do { int f_crono = fase_cambiar(f); __VA_ARGS__; fase_cambiar(f_crono); } while (0)
+#define BYTES(f, n) (bytes_fase[f] += (double)(n))
+
+#else
+
+static inline int fase_cambiar(int f) { (void)f; return FASE_FUERA; }
+
+#define CRONO(f, ...) do { __VA_ARGS__; } while (0)
+#define BYTES(f, n) ((void)sizeof(n))  /* sin evaluar n */
+
+#endif
+
+#define FASE(f) fase_cambiar(f)
+
+/* Empieza a medir, en la fase de preparación; se llama justo después de MPI_Init */
+static inline void tiempos_iniciar(void)
+{
+  int f;
+  for (f=0; f<=NFASES; f++) tiempo_fase[f] = bytes_fase[f] = 0.0;
+#ifndef SIN_TIEMPOS
+  t_fase = MPI_Wtime();
+  fase_actual = FASE_PREPARACION;
+#endif
+}
+
+/* Formatos del registro de bench_escalado.sh (--bench=csv|json) */
+enum FORMATOS {FORMATO_NINGUNO, FORMATO_CSV, FORMATO_JSON};
+
+/*
+ * Registro de una ejecución para el banco de pruebas de escalado
+ *
+ *   De cada fase se toma el máximo entre procesos, que es el que marca el tiempo de
+ *   la resolución. El proceso 0 imprime una sola línea al final de la salida: en CSV
+ *   con las columnas de TIEMPOS_COLUMNAS o como un objeto JSON con los mismos
+ *   campos. variante describe el programa y sus opciones (sin comas).
+ */
+#define TIEMPOS_COLUMNAS "variant,procs,threads,N,M,iterations,total,setup,sweep,halo,reduction,copy,gather"
+
+static inline void tiempos_informe(MPI_Comm comm, int formato, const char *variante,
+                                   int N, int M, int iteraciones, double total)
+{
+  int rank, size, f, hilos = 1;
+  double local[NFASES+1], maximo[NFASES+1];
+
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+#ifdef _OPENMP
+  hilos = omp_get_max_threads();
+#endif
+
+  for (f=0; f<NFASES; f++) local[f] = tiempo_fase[f];
+  local[NFASES] = total;
+  MPI_Reduce(local, maximo, NFASES+1, MPI_DOUBLE, MPI_MAX, 0, comm);
+  if (rank) return;
+
+  if (formato == FORMATO_JSON) {
+    printf("{\"variant\": \"%s\", \"procs\": %d, \"threads\": %d, \"N\": %d, \"M\": %d, "
+           "\"iterations\": %d, \"total\": %.6e", variante, size, hilos, N, M, iteraciones, maximo[NFASES]);
+    for (f=0; f<NFASES; f++) printf(", \"%s\": %.6e", nombre_fase[f], maximo[f]);
+    printf("}\n");
+  }
+  else {
+    printf("%s,%d,%d,%d,%d,%d,%.6e", variante, size, hilos, N, M, iteraciones, maximo[NFASES]);
+    for (f=0; f<NFASES; f++) printf(",%.6e", maximo[f]);
+    printf("\n");
+  }
+}
+
+/*
+ * Resumen de tiempos al final de la resolución (--timing)
+ *
+ *   Para cada fase, el mínimo, la media y el máximo entre procesos, el desequilibrio
+ *   (máximo/media) y los MB enviados por proceso. El diagnóstico compara tres
+ *   pérdidas: el cálculo medio, la espera por desequilibrio (lo que el barrido más
+ *   lento supera a la media, que los demás pasan esperando en el halo o en la
+ *   reducción) y la comunicación media sin esa espera.
+ */
+static inline void tiempos_resumen(MPI_Comm comm)
+{
+  int rank, size, f;
+  double minimo[2*NFASES], maximo[2*NFASES], suma[2*NFASES], local[2*NFASES];
+  double media[NFASES], calculo, desequilibrio, comunicacion;
+
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+  for (f=0; f<NFASES; f++) {
+    local[f] = tiempo_fase[f];
+    local[NFASES+f] = bytes_fase[f];
+  }
+  MPI_Reduce(local, minimo, 2*NFASES, MPI_DOUBLE, MPI_MIN, 0, comm);
+  MPI_Reduce(local, maximo, 2*NFASES, MPI_DOUBLE, MPI_MAX, 0, comm);
+  MPI_Reduce(local, suma, 2*NFASES, MPI_DOUBLE, MPI_SUM, 0, comm);
+  if (rank) return;
+
+#ifdef SIN_TIEMPOS
+  printf("Tiempos por fase desactivados (compilado con -DSIN_TIEMPOS)\n");
+  return;
+#endif
+
+  printf("%-10s %11s %11s %11s %8s %12s %12s\n", "Fase", "mín (s)", "media (s)", "máx (s)",
+         "máx/med", "MB medio", "MB máx");
+  for (f=0; f<NFASES; f++) {
+    media[f] = suma[f]/size;
+    printf("%-10s %11.4e %11.4e %11.4e %8.2f %12.4f %12.4f\n", nombre_fase[f], minimo[f], media[f],
+           maximo[f], (media[f] > 0.0) ? maximo[f]/media[f] : 1.0,
+           suma[NFASES+f]/size/1e6, maximo[NFASES+f]/1e6);
+  }
+
+  calculo = media[FASE_BARRIDO];
+  desequilibrio = maximo[FASE_BARRIDO] - media[FASE_BARRIDO];
+  comunicacion = media[FASE_HALO] + media[FASE_REDUCCION] - desequilibrio;
+  if (comunicacion < 0.0) comunicacion = 0.0;
+  printf("Diagnóstico: cálculo %.3g s, comunicación %.3g s, espera por desequilibrio %.3g s -> ",
+         calculo, comunicacion, desequilibrio);
+  if (calculo >= comunicacion && calculo >= desequilibrio) printf("limitado por el cálculo\n");
+  else if (comunicacion >= desequilibrio) printf("limitado por la red\n");
+  else printf("limitado por el desequilibrio de carga\n");
+}
+
+#endif
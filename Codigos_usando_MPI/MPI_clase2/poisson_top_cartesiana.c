@@ -1,72 +1,1365 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "mpi.h"
+#include "jacobi_kernel.h"
+#include "poisson_io.h"
+#include "poisson_tiempos.h"
+
+/* Vecinos en la malla cartesiana */
+enum DIRS {DOWN, UP, LEFT, RIGHT};
+
+/* Modos de intercambio de halo */
+enum HALO_MODOS {HALO_BLOQUEANTE, HALO_SOLAPADO, HALO_COMPARTIDO, HALO_RMA, HALO_VECINDAD, HALO_VECINDAD_SOLAPADO};
+
+/* Descomposiciones del dominio (--decomp) */
+enum DESCOMPOSICIONES {DESC_2D, DESC_FILAS, DESC_COLUMNAS, DESC_AUTO};
+
+/* Asignación de los procesos a la malla cartesiana (--reorder) */
+enum REORDENES {REORDEN_NODOS, REORDEN_MPI, REORDEN_NINGUNO};
+
+/* Métodos de resolución */
+enum METODOS {METODO_JACOBI, METODO_SOR, METODO_MG_V, METODO_MG_F, METODO_CG, METODO_CG_SEGMENTADO};
+
+/* Opciones del solver (ver main) */
+typedef struct {
+  int metodo;     /* Jacobi, SOR rojo-negro, multigrid (ciclos V o F) o gradiente conjugado */
+  double omega;   /* factor de relajación de SOR */
+  int halo;       /* modo de intercambio de halo */
+  int intervalo;  /* comprobar la convergencia cada "intervalo" iteraciones */
+  int asincrona;  /* reducción de la norma con MPI_Iallreduce, solapada con el barrido siguiente */
+  const char *checkpoint;  /* fichero de checkpoint (NULL: sin checkpoints) */
+  int cada;       /* escribir un checkpoint cada "cada" iteraciones */
+  int reanudar;   /* continuar desde el checkpoint existente */
+  int prof;       /* bloqueo temporal: halo de "prof" celdas, intercambio cada prof iteraciones */
+  int bench;      /* formato del registro de tiempos (poisson_tiempos.h); sin salida por iteración */
+} opciones;
+
+/*
+ * Plan de comunicación del halo
+ *
+ *   Se construye una sola vez por resolución (en jacobi_poisson): rangos de los
+ *   vecinos en la malla cartesiana, el tipo columna ya registrado y las peticiones
+ *   persistentes (MPI_Send_init/MPI_Recv_init) de las cuatro caras. Como x y t
+ *   intercambian sus papeles en cada iteración, hay un juego de peticiones para cada
+ *   uno de los dos vectores y "actual" indica cuál hace de x. En cada iteración solo
+ *   queda MPI_Startall/MPI_Waitall.
+ *
+ *   Con HALO_COMPARTIDO x y t viven en una ventana de memoria compartida del nodo
+ *   (ver halo_plan_compartido) y los bordes de los vecinos del mismo nodo se leen
+ *   directamente de su memoria; solo las caras con vecinos de otro nodo usan mensajes.
+ *
+ *   Con HALO_RMA x y t se exponen como ventanas RMA y cada proceso deposita sus
+ *   bordes en el halo de los vecinos con MPI_Put (ver halo_plan_rma).
+ *
+ *   Con HALO_VECINDAD todo el intercambio es una sola colectiva de vecindad,
+ *   MPI_Neighbor_alltoallw sobre el comunicador cartesiano, y HALO_VECINDAD_SOLAPADO
+ *   usa MPI_Ineighbor_alltoallw para solaparla con el interior como HALO_SOLAPADO.
+ */
+typedef struct {
+  MPI_Comm comm;
+  int rank;
+  int modo;
+  int vecinos[4];
+  MPI_Datatype columna;
+  MPI_Request reqs[2][8];
+  int actual;
+
+  /* memoria compartida (HALO_COMPARTIDO) */
+  MPI_Comm nodo;
+  MPI_Win win;
+  double *vec_mem[4];  /* segmento del vecino si está en el nodo, NULL si no */
+  int vec_n[4], vec_m[4];
+  int en_sitio;        /* el método actualiza x en el sitio (SOR) */
+
+  /* comunicación unilateral (HALO_RMA) */
+  MPI_Win win_rma[2];     /* ventanas sobre x y t */
+  MPI_Group vecindad;     /* grupo de los vecinos, para post/start */
+  MPI_Datatype col_vec[2];  /* columna con el ld del vecino LEFT y RIGHT */
+  MPI_Aint desp_rma[4];   /* posición de nuestro borde en el halo de cada vecino */
+
+  /* colectivas de vecindad (HALO_VECINDAD), en el orden de vecinos de la topología */
+  int cuentas[4];
+  MPI_Datatype tipos[4];
+  MPI_Aint desp_env[4], desp_rec[4];  /* en bytes desde el inicio de x */
+  MPI_Request req_vec;
+} halo_plan;
+
+/*
+ * Parte del plan que no depende de los vectores: vecinos y tipo columna
+ */
+void halo_plan_topologia(halo_plan *plan,int N,int M, MPI_Comm *comm_cart)
+{
+  plan->comm = *comm_cart;
+  MPI_Comm_rank(*comm_cart, &plan->rank);
+
+  // Identificamos los vecinos de la malla
+  MPI_Cart_shift( *comm_cart , 0 , 1 , &plan->vecinos[LEFT] , &plan->vecinos[RIGHT]);
+  MPI_Cart_shift( *comm_cart , 1 , 1 , &plan->vecinos[DOWN] , &plan->vecinos[UP]);
+
+  // Creamos el tipo para cuando mandemos columnas a la derecha e izquierda
+  MPI_Type_vector( N , 1 , M+2 , MPI_DOUBLE , &plan->columna);
+  MPI_Type_commit( &plan->columna);
+
+  /* Argumentos de MPI_Neighbor_alltoallw: la topología cartesiana ordena los vecinos
+     por dimensiones, primero el de coordenada menor, es decir LEFT, RIGHT, DOWN, UP */
+  int ld = M+2, d, orden[4] = {LEFT, RIGHT, DOWN, UP};
+  for (d=0; d<4; d++) {
+    if (orden[d] == LEFT || orden[d] == RIGHT) {
+      plan->cuentas[d] = 1;
+      plan->tipos[d] = plan->columna;
+    }
+    else {
+      plan->cuentas[d] = M;
+      plan->tipos[d] = MPI_DOUBLE;
+    }
+  }
+  plan->desp_env[0] = (1*ld+1)*sizeof(double);    plan->desp_rec[0] = (1*ld+0)*sizeof(double);
+  plan->desp_env[1] = (1*ld+M)*sizeof(double);    plan->desp_rec[1] = (1*ld+M+1)*sizeof(double);
+  plan->desp_env[2] = (N*ld+1)*sizeof(double);    plan->desp_rec[2] = ((N+1)*ld+1)*sizeof(double);
+  plan->desp_env[3] = (1*ld+1)*sizeof(double);    plan->desp_rec[3] = (0*ld+1)*sizeof(double);
+  plan->req_vec = MPI_REQUEST_NULL;
+}
+
+void halo_plan_crear(halo_plan *plan,int N,int M,double *x,double *t, MPI_Comm *comm_cart, int modo)
+{
+  int c, ld = M+2;
+  double *v[2] = {x, t};
+  MPI_Request *reqs;
+
+  halo_plan_topologia(plan,N,M,comm_cart);
+  plan->modo = modo;
+
+  for (c=0; c<2; c++) {
+    x = v[c];
+    reqs = plan->reqs[c];
+
+    // Recepciones en las celdas fantasma
+    MPI_Recv_init( &x[1*ld+0] , 1 , plan->columna , plan->vecinos[LEFT] , 0 , *comm_cart , &reqs[0]);
+    MPI_Recv_init( &x[1*ld+M+1] , 1 , plan->columna , plan->vecinos[RIGHT] , 0 , *comm_cart , &reqs[1]);
+    MPI_Recv_init( &x[0*ld+1] , M , MPI_DOUBLE , plan->vecinos[UP] , 0 , *comm_cart , &reqs[2]);
+    MPI_Recv_init( &x[(N+1)*ld+1] , M , MPI_DOUBLE , plan->vecinos[DOWN] , 0 , *comm_cart , &reqs[3]);
+
+    // Envío de los bordes propios
+    MPI_Send_init( &x[1*ld+M] , 1 , plan->columna , plan->vecinos[RIGHT] , 0 , *comm_cart , &reqs[4]);
+    MPI_Send_init( &x[1*ld+1] , 1 , plan->columna , plan->vecinos[LEFT] , 0 , *comm_cart , &reqs[5]);
+    MPI_Send_init( &x[N*ld+1] , M , MPI_DOUBLE , plan->vecinos[DOWN] , 0 , *comm_cart , &reqs[6]);
+    MPI_Send_init( &x[1*ld+1] , M , MPI_DOUBLE , plan->vecinos[UP] , 0 , *comm_cart , &reqs[7]);
+  }
+  plan->actual = 0;
+}
+
+/*
+ * Halo en memoria compartida
+ *
+ *   Agrupa los procesos del nodo con MPI_Comm_split_type(MPI_COMM_TYPE_SHARED) y
+ *   reserva x y t seguidos en una ventana de MPI_Win_allocate_shared, que sustituyen
+ *   a los vectores *x y *t (el llamador copia en ellos el iterado inicial). Para cada
+ *   vecino del mismo nodo se guarda la dirección de su segmento y las dimensiones de
+ *   su bloque, que hacen falta para localizar sus bordes.
+ */
+void halo_plan_compartido(halo_plan *plan,int N,int M,double **x,double **t)
+{
+  int d, r, tam = (N+2)*(M+2), disp, nproc, propias[2], *dims;
+  MPI_Aint bytes;
+  MPI_Group g_cart, g_nodo;
+  MPI_Info info;
+  double *base;
+
+  MPI_Comm_split_type( plan->comm , MPI_COMM_TYPE_SHARED , plan->rank , MPI_INFO_NULL , &plan->nodo);
+  MPI_Info_create( &info);
+  MPI_Info_set( info , "alloc_shared_noncontig" , "true");
+  MPI_Win_allocate_shared( 2*tam*(MPI_Aint)sizeof(double) , sizeof(double) , info , plan->nodo , &base , &plan->win);
+  MPI_Info_free( &info);
+  MPI_Win_lock_all( MPI_MODE_NOCHECK , plan->win);
+  memset(base, 0, 2*tam*sizeof(double));
+  *x = base;
+  *t = base + tam;
+
+  /* dimensiones de los bloques del nodo: el tamaño del segmento que devuelve
+     MPI_Win_shared_query puede estar redondeado a páginas y no sirve para deducirlas */
+  MPI_Comm_size( plan->nodo , &nproc);
+  dims = (int*)malloc(2*nproc*sizeof(int));
+  propias[0] = N; propias[1] = M;
+  MPI_Allgather( propias , 2 , MPI_INT , dims , 2 , MPI_INT , plan->nodo);
+
+  MPI_Comm_group( plan->comm , &g_cart);
+  MPI_Comm_group( plan->nodo , &g_nodo);
+  for (d=0; d<4; d++) {
+    plan->vec_mem[d] = NULL;
+    if (plan->vecinos[d] == MPI_PROC_NULL) continue;
+    MPI_Group_translate_ranks( g_cart , 1 , &plan->vecinos[d] , g_nodo , &r);
+    if (r == MPI_UNDEFINED) continue;
+    MPI_Win_shared_query( plan->win , r , &bytes , &disp , &plan->vec_mem[d]);
+    plan->vec_n[d] = dims[2*r];
+    plan->vec_m[d] = dims[2*r+1];
+  }
+  MPI_Group_free( &g_cart);
+  MPI_Group_free( &g_nodo);
+  free(dims);
+
+  /* los vecinos no leen hasta que todos han puesto su segmento a cero */
+  MPI_Win_sync( plan->win);
+  MPI_Barrier( plan->nodo);
+}
+
+/*
+ * Halo con comunicación unilateral
+ *
+ *   Cada uno de los dos vectores se expone en una ventana (MPI_Win_create) y la
+ *   sincronización es post-start-complete-wait limitada al grupo de los vecinos
+ *   cartesianos, sin emparejar envíos y recepciones. Para saber dónde escribir en
+ *   el halo de cada vecino hace falta el tamaño de su bloque, que se intercambia
+ *   aquí una sola vez.
+ */
+void halo_plan_rma(halo_plan *plan,int N,int M,double *x,double *t)
+{
+  int d, err, nv = 0, propias[2] = {N, M}, dims[4][2], rangos[4];
+  int opuesta[4] = {UP, DOWN, RIGHT, LEFT};
+  MPI_Group g_cart;
+
+  // Desplazamiento en cada dirección: se envía hacia d y se recibe del vecino opuesto
+  for (d=0; d<4; d++) {
+    dims[opuesta[d]][0] = N; dims[opuesta[d]][1] = M;
+    MPI_Sendrecv( propias , 2 , MPI_INT , plan->vecinos[d] , 1 ,
+                  dims[opuesta[d]] , 2 , MPI_INT , plan->vecinos[opuesta[d]] , 1 , plan->comm , MPI_STATUS_IGNORE);
+  }
+
+  // Nuestro borde va al halo opuesto del vecino
+  plan->desp_rma[DOWN] = 0*(MPI_Aint)(M+2) + 1;
+  plan->desp_rma[UP] = (dims[UP][0]+1)*(MPI_Aint)(M+2) + 1;
+  plan->desp_rma[LEFT] = 1*(MPI_Aint)(dims[LEFT][1]+2) + dims[LEFT][1]+1;
+  plan->desp_rma[RIGHT] = 1*(MPI_Aint)(dims[RIGHT][1]+2) + 0;
+  MPI_Type_vector( N , 1 , dims[LEFT][1]+2 , MPI_DOUBLE , &plan->col_vec[0]);
+  MPI_Type_vector( N , 1 , dims[RIGHT][1]+2 , MPI_DOUBLE , &plan->col_vec[1]);
+  MPI_Type_commit( &plan->col_vec[0]);
+  MPI_Type_commit( &plan->col_vec[1]);
+
+  /* si la biblioteca no puede crear las ventanas se vuelve al intercambio bloqueante */
+  MPI_Comm_set_errhandler( plan->comm , MPI_ERRORS_RETURN);
+  err = MPI_Win_create( x , (N+2)*(M+2)*(MPI_Aint)sizeof(double) , sizeof(double) , MPI_INFO_NULL , plan->comm , &plan->win_rma[0]);
+  if (err == MPI_SUCCESS) {
+    err = MPI_Win_create( t , (N+2)*(M+2)*(MPI_Aint)sizeof(double) , sizeof(double) , MPI_INFO_NULL , plan->comm , &plan->win_rma[1]);
+    if (err != MPI_SUCCESS) MPI_Win_free( &plan->win_rma[0]);
+  }
+  MPI_Comm_set_errhandler( plan->comm , MPI_ERRORS_ARE_FATAL);
+  MPI_Allreduce( MPI_IN_PLACE , &err , 1 , MPI_INT , MPI_MAX , plan->comm);
+  if (err != MPI_SUCCESS) {
+    if (!plan->rank) printf("Aviso: no se pueden crear las ventanas RMA, se usa el halo bloqueante\n");
+    MPI_Type_free( &plan->col_vec[0]);
+    MPI_Type_free( &plan->col_vec[1]);
+    plan->modo = HALO_BLOQUEANTE;
+    return;
+  }
+
+  // Grupo de los vecinos (sin repetidos: con dos procesos en una dimensión no hay periodicidad)
+  for (d=0; d<4; d++)
+    if (plan->vecinos[d] != MPI_PROC_NULL) rangos[nv++] = plan->vecinos[d];
+  MPI_Comm_group( plan->comm , &g_cart);
+  MPI_Group_incl( g_cart , nv , rangos , &plan->vecindad);
+  MPI_Group_free( &g_cart);
+}
+
+void halo_plan_liberar(halo_plan *plan)
+{
+  int c, i;
+  for (c=0; c<2; c++)
+    for (i=0; i<8; i++) MPI_Request_free( &plan->reqs[c][i]);
+  MPI_Type_free( &plan->columna);
+  if (plan->modo == HALO_COMPARTIDO) {
+    MPI_Win_unlock_all( plan->win);
+    MPI_Win_free( &plan->win);
+    MPI_Comm_free( &plan->nodo);
+  }
+  if (plan->modo == HALO_RMA) {
+    MPI_Win_free( &plan->win_rma[0]);
+    MPI_Win_free( &plan->win_rma[1]);
+    MPI_Type_free( &plan->col_vec[0]);
+    MPI_Type_free( &plan->col_vec[1]);
+    MPI_Group_free( &plan->vecindad);
+  }
+}
+
+/* Bytes que envía un intercambio de halo con mensajes de "fila" elementos hacia
+   UP/DOWN y de "columna" elementos hacia LEFT/RIGHT (para poisson_tiempos.h) */
+static double halo_bytes(halo_plan *plan, int fila, int columna)
+{
+  int *vec = plan->vecinos;
+  return sizeof(double)*((double)((vec[UP] != MPI_PROC_NULL) + (vec[DOWN] != MPI_PROC_NULL))*fila
+                         + (double)((vec[LEFT] != MPI_PROC_NULL) + (vec[RIGHT] != MPI_PROC_NULL))*columna);
+}
+
+/*
+ * Intercambio del halo de un vector cualquiera, incluidas las esquinas
+ *
+ *   Primero se intercambian las columnas y después las filas completas (de la
+ *   columna 0 a la M+1), de modo que las esquinas fantasma reciben el valor del
+ *   vecino en diagonal. Lo usan el multigrid (restricción y prolongación) y los
+ *   métodos que trabajan sobre vectores distintos de x y t.
+ */
+void halo_intercambio(halo_plan *plan,int N,int M,double *x)
+{
+  int ld = M+2;
+  MPI_Request reqs[4];
+  int f_previa = FASE(FASE_HALO);
+
+  BYTES(FASE_HALO, halo_bytes(plan,ld,N));
+
+  MPI_Irecv( &x[1*ld+0] , 1 , plan->columna , plan->vecinos[LEFT] , 0 , plan->comm , &reqs[0]);
+  MPI_Irecv( &x[1*ld+M+1] , 1 , plan->columna , plan->vecinos[RIGHT] , 0 , plan->comm , &reqs[1]);
+  MPI_Isend( &x[1*ld+M] , 1 , plan->columna , plan->vecinos[RIGHT] , 0 , plan->comm , &reqs[2]);
+  MPI_Isend( &x[1*ld+1] , 1 , plan->columna , plan->vecinos[LEFT] , 0 , plan->comm , &reqs[3]);
+  MPI_Waitall( 4 , reqs , MPI_STATUSES_IGNORE);
+
+  MPI_Irecv( &x[0*ld] , ld , MPI_DOUBLE , plan->vecinos[UP] , 0 , plan->comm , &reqs[0]);
+  MPI_Irecv( &x[(N+1)*ld] , ld , MPI_DOUBLE , plan->vecinos[DOWN] , 0 , plan->comm , &reqs[1]);
+  MPI_Isend( &x[N*ld] , ld , MPI_DOUBLE , plan->vecinos[DOWN] , 0 , plan->comm , &reqs[2]);
+  MPI_Isend( &x[1*ld] , ld , MPI_DOUBLE , plan->vecinos[UP] , 0 , plan->comm , &reqs[3]);
+  MPI_Waitall( 4 , reqs , MPI_STATUSES_IGNORE);
+  FASE(f_previa);
+}
+
+/*
+ * Intercambio bloqueante del halo con el orden pares-impares
+ */
+static void halo_bloqueante(int N,int M,double *x, halo_plan *plan)
+{
+  int ld = M+2;
+  int *neighbours_ranks = plan->vecinos;
+  MPI_Datatype columna = plan->columna;
+  MPI_Comm comm_cart = plan->comm;
+
+  // Envío de columnas
+  if (plan->rank%2 == 0){
+    MPI_Send( &x[1*ld+M] , 1 , columna , neighbours_ranks[RIGHT] , 0 , comm_cart);
+    MPI_Recv( &x[1*ld+0] , 1 , columna , neighbours_ranks[LEFT] , 0 , comm_cart , MPI_STATUS_IGNORE);
+    MPI_Send( &x[1*ld+1] , 1 , columna , neighbours_ranks[LEFT] , 0 , comm_cart);
+    MPI_Recv( &x[1*ld+M+1] , 1 , columna , neighbours_ranks[RIGHT] , 0 , comm_cart , MPI_STATUS_IGNORE);
+  }
+  else{
+    MPI_Recv( &x[1*ld+0] , 1 , columna , neighbours_ranks[LEFT] , 0 , comm_cart , MPI_STATUS_IGNORE);
+    MPI_Send( &x[1*ld+M] , 1 , columna , neighbours_ranks[RIGHT] , 0 , comm_cart);
+    MPI_Recv( &x[1*ld+M+1] , 1 , columna , neighbours_ranks[RIGHT] , 0 , comm_cart , MPI_STATUS_IGNORE);
+    MPI_Send( &x[1*ld+1] , 1 , columna , neighbours_ranks[LEFT] , 0 , comm_cart);
+  }
+
+  // Envío de filas
+  if (plan->rank%2 == 0){
+    MPI_Send( &x[N*ld+1] , M , MPI_DOUBLE , neighbours_ranks[DOWN] , 0 , comm_cart);
+    MPI_Recv( &x[0*ld+1] , M , MPI_DOUBLE , neighbours_ranks[UP] , 0 , comm_cart , MPI_STATUS_IGNORE);
+    MPI_Send( &x[1*ld+1] , M , MPI_DOUBLE , neighbours_ranks[UP] , 0 , comm_cart);
+    MPI_Recv( &x[(N+1)*ld+1] , M , MPI_DOUBLE , neighbours_ranks[DOWN] , 0 , comm_cart , MPI_STATUS_IGNORE);
+  }
+  else{
+    MPI_Recv( &x[0*ld+1] , M , MPI_DOUBLE , neighbours_ranks[UP] , 0 , comm_cart , MPI_STATUS_IGNORE);
+    MPI_Send( &x[N*ld+1] , M , MPI_DOUBLE , neighbours_ranks[DOWN] , 0 , comm_cart);
+    MPI_Recv( &x[(N+1)*ld+1] , M , MPI_DOUBLE , neighbours_ranks[DOWN] , 0 , comm_cart , MPI_STATUS_IGNORE);
+    MPI_Send( &x[1*ld+1] , M , MPI_DOUBLE , neighbours_ranks[UP] , 0 , comm_cart);
+  }
+}
+
+/*
+ * Intercambio del halo con memoria compartida
+ *
+ *   Tras una barrera del nodo (los vecinos han terminado de escribir x), las caras
+ *   de los vecinos del nodo se copian directamente de su segmento, del vector que
+ *   indica plan->actual; las demás caras se intercambian con mensajes. Con Jacobi
+ *   los vecinos escriben mientras tanto en el otro vector, pero un método en el
+ *   sitio (SOR) necesita una segunda barrera para que nadie escriba en x mientras
+ *   otro lee sus bordes.
+ */
+static void halo_compartido(int N,int M,double *x, halo_plan *plan)
+{
+  int i, j, nr = 0, ld = M+2, ldv;
+  int *vec = plan->vecinos;
+  double *v;
+  MPI_Request reqs[8];
+
+  MPI_Win_sync( plan->win);
+  MPI_Barrier( plan->nodo);
+  MPI_Win_sync( plan->win);
+
+  // Mensajes con los vecinos de otros nodos
+  if (!plan->vec_mem[LEFT]) {
+    MPI_Irecv( &x[1*ld+0] , 1 , plan->columna , vec[LEFT] , 0 , plan->comm , &reqs[nr++]);
+    MPI_Isend( &x[1*ld+1] , 1 , plan->columna , vec[LEFT] , 0 , plan->comm , &reqs[nr++]);
+  }
+  if (!plan->vec_mem[RIGHT]) {
+    MPI_Irecv( &x[1*ld+M+1] , 1 , plan->columna , vec[RIGHT] , 0 , plan->comm , &reqs[nr++]);
+    MPI_Isend( &x[1*ld+M] , 1 , plan->columna , vec[RIGHT] , 0 , plan->comm , &reqs[nr++]);
+  }
+  if (!plan->vec_mem[UP]) {
+    MPI_Irecv( &x[0*ld+1] , M , MPI_DOUBLE , vec[UP] , 0 , plan->comm , &reqs[nr++]);
+    MPI_Isend( &x[1*ld+1] , M , MPI_DOUBLE , vec[UP] , 0 , plan->comm , &reqs[nr++]);
+  }
+  if (!plan->vec_mem[DOWN]) {
+    MPI_Irecv( &x[(N+1)*ld+1] , M , MPI_DOUBLE , vec[DOWN] , 0 , plan->comm , &reqs[nr++]);
+    MPI_Isend( &x[N*ld+1] , M , MPI_DOUBLE , vec[DOWN] , 0 , plan->comm , &reqs[nr++]);
+  }
+
+  // Lectura directa de los vecinos del nodo
+  if (plan->vec_mem[LEFT]) {
+    ldv = plan->vec_m[LEFT]+2;
+    v = plan->vec_mem[LEFT] + plan->actual*(N+2)*ldv;
+    for (i=1; i<=N; i++) x[i*ld+0] = v[i*ldv+plan->vec_m[LEFT]];
+  }
+  if (plan->vec_mem[RIGHT]) {
+    ldv = plan->vec_m[RIGHT]+2;
+    v = plan->vec_mem[RIGHT] + plan->actual*(N+2)*ldv;
+    for (i=1; i<=N; i++) x[i*ld+M+1] = v[i*ldv+1];
+  }
+  if (plan->vec_mem[UP]) {
+    v = plan->vec_mem[UP] + plan->actual*(plan->vec_n[UP]+2)*ld;
+    for (j=1; j<=M; j++) x[0*ld+j] = v[plan->vec_n[UP]*ld+j];
+  }
+  if (plan->vec_mem[DOWN]) {
+    v = plan->vec_mem[DOWN] + plan->actual*(plan->vec_n[DOWN]+2)*ld;
+    for (j=1; j<=M; j++) x[(N+1)*ld+j] = v[1*ld+j];
+  }
+
+  MPI_Waitall( nr , reqs , MPI_STATUSES_IGNORE);
+  if (plan->en_sitio) MPI_Barrier( plan->nodo);
+}
+
+/*
+ * Intercambio del halo con MPI_Put
+ *
+ *   Se expone la ventana del vector actual a los vecinos (post), se abre el acceso
+ *   a las suyas (start), se depositan los bordes propios y, tras complete/wait,
+ *   todos los Put dirigidos a nuestro halo han terminado. Un vecino no puede volver
+ *   a escribir en el halo hasta el siguiente post, que llega después del barrido.
+ */
+static void halo_rma(int N,int M,double *x, halo_plan *plan)
+{
+  int ld = M+2;
+  int *vec = plan->vecinos;
+  MPI_Win win = plan->win_rma[plan->actual];
+
+  MPI_Win_post( plan->vecindad , 0 , win);
+  MPI_Win_start( plan->vecindad , 0 , win);
+
+  if (vec[DOWN] != MPI_PROC_NULL)
+    MPI_Put( &x[N*ld+1] , M , MPI_DOUBLE , vec[DOWN] , plan->desp_rma[DOWN] , M , MPI_DOUBLE , win);
+  if (vec[UP] != MPI_PROC_NULL)
+    MPI_Put( &x[1*ld+1] , M , MPI_DOUBLE , vec[UP] , plan->desp_rma[UP] , M , MPI_DOUBLE , win);
+  if (vec[LEFT] != MPI_PROC_NULL)
+    MPI_Put( &x[1*ld+1] , 1 , plan->columna , vec[LEFT] , plan->desp_rma[LEFT] , 1 , plan->col_vec[0] , win);
+  if (vec[RIGHT] != MPI_PROC_NULL)
+    MPI_Put( &x[1*ld+M] , 1 , plan->columna , vec[RIGHT] , plan->desp_rma[RIGHT] , 1 , plan->col_vec[1] , win);
+
+  MPI_Win_complete( win);
+  MPI_Win_wait( win);
+}
+
+/*
+ * Intercambio del halo de x en los modos sin solapamiento
+ */
+static void halo_actualizar(int N,int M,double *x, halo_plan *plan)
+{
+  BYTES(FASE_HALO, halo_bytes(plan,M,N));
+  if (plan->modo == HALO_COMPARTIDO) halo_compartido(N,M,x,plan);
+  else if (plan->modo == HALO_RMA) halo_rma(N,M,x,plan);
+  else if (plan->modo == HALO_VECINDAD)
+    MPI_Neighbor_alltoallw( x , plan->cuentas , plan->desp_env , plan->tipos ,
+                            x , plan->cuentas , plan->desp_rec , plan->tipos , plan->comm);
+  else halo_bloqueante(N,M,x,plan);
+}
+
+/*
+ * Modos con solapamiento: halo_iniciar lanza el intercambio del halo de x y
+ * halo_esperar lo completa; entre ambas llamadas solo se pueden leer los puntos
+ * que no son bordes
+ */
+static int halo_solapa(halo_plan *plan)
+{
+  return plan->modo == HALO_SOLAPADO || plan->modo == HALO_VECINDAD_SOLAPADO;
+}
+
+static void halo_iniciar(double *x, halo_plan *plan, int N, int M)
+{
+  BYTES(FASE_HALO, halo_bytes(plan,M,N));
+  if (plan->modo == HALO_VECINDAD_SOLAPADO)
+    MPI_Ineighbor_alltoallw( x , plan->cuentas , plan->desp_env , plan->tipos ,
+                             x , plan->cuentas , plan->desp_rec , plan->tipos , plan->comm , &plan->req_vec);
+  else MPI_Startall( 8 , plan->reqs[plan->actual]);
+}
+
+static void halo_esperar(halo_plan *plan)
+{
+  if (plan->modo == HALO_VECINDAD_SOLAPADO) MPI_Wait( &plan->req_vec , MPI_STATUS_IGNORE);
+  else MPI_Waitall( 8 , plan->reqs[plan->actual] , MPI_STATUSES_IGNORE);
+}
+
+/*
+ * Un paso del método de Jacobi para la ecuación de Poisson
+ *
+ *   Argumentos:
+ *     - N,M: dimensiones de la malla
+ *     - Entrada: x es el vector de la iteración anterior, b es la parte derecha del sistema
+ *     - Salida: t es el nuevo vector; se devuelve la suma local de (x-t)^2
+ *     - plan: plan del halo; plan->actual debe corresponder al vector x
+ *
+ *   Se asume que x,b,t son de dimensión (N+2)*(M+2), se recorren solo los puntos interiores
+ *   de la malla, y en los bordes están almacenadas las condiciones de frontera (por defecto 0).
+ *
+ *   Con HALO_BLOQUEANTE (o HALO_COMPARTIDO, HALO_RMA, HALO_VECINDAD) se intercambia el halo y después se
+ *   calcula toda la malla. Con HALO_SOLAPADO (o HALO_VECINDAD_SOLAPADO) se arrancan las
+ *   peticiones persistentes (o la colectiva no bloqueante) y, mientras los mensajes están
+ *   en vuelo, se actualizan los puntos interiores que no dependen de las celdas fantasma
+ *   (filas 2..N-1, columnas 2..M-1); tras el MPI_Waitall se completan las filas 1 y N y
+ *   las columnas 1 y M.
+ */
+double jacobi_step(int N,int M,double *x,double *b,double *t, halo_plan *plan)
+{
+  int ld = M+2;
+  double s;
+
+  if (!halo_solapa(plan)){
+    CRONO(FASE_HALO, halo_actualizar(N,M,x,plan));
+    CRONO(FASE_BARRIDO, s = jacobi_kernel(1,N,1,M,ld,x,b,t));
+    return s;
+  }
+
+  CRONO(FASE_HALO, halo_iniciar(x,plan,N,M));
+
+  // Interior: no necesita datos de los vecinos
+  CRONO(FASE_BARRIDO, s = jacobi_kernel(2,N-1,2,M-1,ld,x,b,t));
+
+  CRONO(FASE_HALO, halo_esperar(plan));
+
+  // Bordes: filas 1 y N completas, columnas 1 y M sin las esquinas
+  CRONO(FASE_BARRIDO,
+    s += jacobi_kernel(1,1,1,M,ld,x,b,t);
+    if (N > 1) s += jacobi_kernel(N,N,1,M,ld,x,b,t);
+    s += jacobi_kernel(2,N-1,1,1,ld,x,b,t);
+    if (M > 1) s += jacobi_kernel(2,N-1,M,M,ld,x,b,t);
+  );
+  return s;
+}
+
+/*
+ * Un paso de SOR rojo-negro para la ecuación de Poisson
+ *
+ *   Actualiza x en el sitio, primero los puntos rojos y después los negros, con un
+ *   intercambio de halo antes de cada color (con el mismo plan y modo que Jacobi) para
+ *   que cada semibarrido vea los valores del otro color ya actualizados en los
+ *   vecinos. desp es la paridad del desplazamiento global del bloque. Devuelve la
+ *   suma local de ||x_{k}-x_{k+1}||^2.
+ */
+double sor_step(int N,int M,double *x,double *b, halo_plan *plan, double omega, int desp)
+{
+  int color, c, ld = M+2;
+  double s = 0.0;
+
+  for (color=0; color<2; color++) {
+    c = (color+desp)%2;
+
+    if (!halo_solapa(plan)){
+      CRONO(FASE_HALO, halo_actualizar(N,M,x,plan));
+      CRONO(FASE_BARRIDO, s += sor_kernel(1,N,1,M,ld,c,omega,x,b));
+      continue;
+    }
+
+    CRONO(FASE_HALO, halo_iniciar(x,plan,N,M));
+    CRONO(FASE_BARRIDO, s += sor_kernel(2,N-1,2,M-1,ld,c,omega,x,b));
+    CRONO(FASE_HALO, halo_esperar(plan));
+
+    CRONO(FASE_BARRIDO,
+      s += sor_kernel(1,1,1,M,ld,c,omega,x,b);
+      if (N > 1) s += sor_kernel(N,N,1,M,ld,c,omega,x,b);
+      s += sor_kernel(2,N-1,1,1,ld,c,omega,x,b);
+      if (M > 1) s += sor_kernel(2,N-1,M,M,ld,c,omega,x,b);
+    );
+  }
+  return s;
+}
+
+/*
+ * Reparto por bloques de N elementos entre P partes: la parte r tiene *n
+ * elementos a partir del *ini (base 0). Las N%P primeras partes llevan un
+ * elemento más, así que vale para cualquier N y P.
+ */
+void reparto_bloques(int N,int P,int r,int *n,int *ini)
+{
+  int q = N/P, resto = N%P;
+  *n = q + (r < resto);
+  *ini = r*q + (r < resto ? r : resto);
+}
+
+/*
+ * Bloque de un proceso en la malla global NgxMg
+ *
+ *   Las filas se reparten con reparto_bloques entre las dims[1] filas de procesos y
+ *   las columnas entre las dims[0] columnas de procesos, así que los vecinos LEFT y
+ *   RIGHT tienen las mismas filas y los vecinos DOWN y UP las mismas columnas. El
+ *   vecino UP (coordenada 1 mayor) está encima, así que la fila global crece al bajar
+ *   en la coordenada 1. Devuelve las dimensiones NxM del bloque del proceso con
+ *   coordenadas coords y los índices globales (desde 1) de su primera fila y columna.
+ */
+void bloque_coords(const int *dims,const int *coords,int Ng,int Mg,int *N,int *M,int *fila0,int *col0)
+{
+  reparto_bloques(Ng,dims[1],dims[1]-1-coords[1],N,fila0);
+  reparto_bloques(Mg,dims[0],coords[0],M,col0);
+  (*fila0)++;
+  (*col0)++;
+}
+
+/* Bloque del proceso local en la malla global NgxMg (ver bloque_coords) */
+void bloque_global(MPI_Comm *comm_cart,int Ng,int Mg,int *N,int *M,int *fila0,int *col0)
+{
+  int dims[2], periods[2], coords[2];
+  MPI_Cart_get(*comm_cart, 2, dims, periods, coords);
+  bloque_coords(dims,coords,Ng,Mg,N,M,fila0,col0);
+}
+
+/*
+ * Multigrid geométrico distribuido
+ *
+ *   Jerarquía de mallas por vértices: el punto grueso G corresponde al punto fino
+ *   2G (índices globales desde 1), así que una malla de N puntos pasa a N/2 (por
+ *   defecto) y se engrosa mientras N y M son al menos 2. Con N = 2^k-1 la frontera
+ *   gruesa coincide con la fina. Con N par la frontera final queda a menos de un
+ *   paso grueso del último punto: en el nivel l el hueco es dy*H (0 < dy <= 1), con
+ *   dy = (dy_fino + N_fino%2)/2, y la última fila usa el Laplaciano de paso no
+ *   uniforme (vecino 2/(1+dy), diagonal 2/dy en esa dirección, ver mg_borde); la
+ *   prolongación interpola linealmente con ese hueco. Lo mismo para las columnas con
+ *   dx. Cada bloque grueso se deduce del bloque fino del
+ *   mismo rank (las filas globales [a, a+n-1] dan las filas gruesas
+ *   [ceil(a/2), floor((a+n-1)/2)]), por lo que la descomposición de todos los
+ *   niveles es coherente sin comunicación adicional y los niveles distribuidos usan
+ *   el mismo comunicador cartesiano y el mismo intercambio de halo que Jacobi.
+ *
+ *   Suavizador: Jacobi ponderado (w = 4/5). Restricción: ponderación completa de 9
+ *   puntos. Prolongación: interpolación bilineal. El sistema está escalado por h^2,
+ *   así que la parte derecha gruesa es 4*R(r).
+ *
+ *   Aglomeración: cuando algún rank se quedaría con menos de 2 filas o columnas en el
+ *   nivel siguiente, ese nivel y los más gruesos se reúnen en el rank 0 del
+ *   comunicador (un comunicador cartesiano 1x1), que sigue el ciclo en solitario. El
+ *   resto de ranks espera la corrección gruesa, que el rank 0 les devuelve ya con las
+ *   celdas fantasma que necesita la prolongación.
+ */
+#define MG_MAX_NIVELES 32
+#define MG_NU 2        /* barridos de pre y post-suavizado */
+#define MG_W 0.8       /* peso del Jacobi ponderado */
+
+enum MG_CICLOS {MG_V, MG_F};
+
+typedef struct {
+  int activo;          /* el rank participa en este nivel */
+  int n, m;            /* puntos interiores locales */
+  int a, c;            /* índice global de la primera fila y columna locales */
+  int N, M;            /* puntos interiores globales */
+  double dy, dx;       /* hueco entre la última fila (columna) y la frontera, en pasos del nivel */
+  MPI_Comm comm;       /* comunicador cartesiano del nivel */
+  int comm_propio;     /* comm creado por el multigrid (hay que liberarlo) */
+  halo_plan plan;      /* solo topología: vecinos y tipo columna */
+  double *u, *t, *f, *r;
+  /* transferencia al nivel siguiente */
+  int aglomera;        /* el nivel siguiente vive solo en el rank 0 */
+  int nc, mc, ac, cc;  /* bloque grueso deducido de este bloque */
+  double *fc, *ec;     /* parte derecha y corrección gruesas del bloque deducido (si aglomera) */
+  int *bloques;        /* (si aglomera, en el rank 0) nc,mc,ac,cc de cada rank */
+} mg_nivel;
+
+typedef struct {
+  int nniveles;
+  mg_nivel niv[MG_MAX_NIVELES];
+  double *x0;          /* iterado anterior, para el criterio de parada */
+} multigrid;
+
+static void mg_nivel_reservar(mg_nivel *L)
+{
+  int tam = (L->n+2)*(L->m+2);
+  L->u = (double*)calloc(tam,sizeof(double));
+  L->f = (double*)calloc(tam,sizeof(double));
+  L->t = (double*)calloc(tam,sizeof(double));
+  L->r = (double*)calloc(tam,sizeof(double));
+}
+
+/*
+ * Construye la jerarquía a partir del bloque local NxM (primera fila y columna
+ * globales fila0, col0; malla global NgxMg) sobre los vectores x y b del solver.
+ */
+void mg_crear(multigrid *mg,int N,int M,int fila0,int col0,int Ng,int Mg,double *x,double *b, MPI_Comm *comm_cart)
+{
+  int l, minimo, global, size, rank, bloque[4];
+  mg_nivel *L, *C;
+
+  memset(mg, 0, sizeof(multigrid));
+  L = &mg->niv[0];
+  L->activo = 1;
+  L->n = N; L->m = M; L->a = fila0; L->c = col0; L->N = Ng; L->M = Mg;
+  L->dy = L->dx = 1.0;
+  L->comm = *comm_cart;
+  L->u = x;
+  L->f = b;
+  L->t = (double*)calloc((N+2)*(M+2),sizeof(double));
+  L->r = (double*)calloc((N+2)*(M+2),sizeof(double));
+  halo_plan_topologia(&L->plan,N,M,&L->comm);
+  mg->x0 = (double*)calloc((N+2)*(M+2),sizeof(double));
+  mg->nniveles = 1;
+
+  for (l=0; l+1<MG_MAX_NIVELES; l++) {
+    L = &mg->niv[l];
+    if (!L->activo || L->N < 2 || L->M < 2) break;
+
+    /* bloque grueso deducido */
+    L->ac = (L->a+1)/2;
+    L->nc = (L->a+L->n-1)/2 - L->ac + 1;
+    L->cc = (L->c+1)/2;
+    L->mc = (L->c+L->m-1)/2 - L->cc + 1;
+
+    minimo = (L->nc < L->mc) ? L->nc : L->mc;
+    MPI_Allreduce( &minimo , &global , 1 , MPI_INT , MPI_MIN , L->comm);
+    MPI_Comm_size(L->comm, &size);
+    MPI_Comm_rank(L->comm, &rank);
+    L->aglomera = (global < 2 && size > 1);
+
+    C = &mg->niv[l+1];
+    C->N = L->N/2;
+    C->M = L->M/2;
+    C->dy = (L->dy + L->N%2)/2.0;
+    C->dx = (L->dx + L->M%2)/2.0;
+    mg->nniveles = l+2;
+
+    if (!L->aglomera) {
+      C->activo = 1;
+      C->n = L->nc; C->m = L->mc; C->a = L->ac; C->c = L->cc;
+      C->comm = L->comm;
+      mg_nivel_reservar(C);
+      halo_plan_topologia(&C->plan,C->n,C->m,&C->comm);
+      continue;
+    }
+
+    /* aglomeración en el rank 0 de este nivel */
+    L->fc = (double*)calloc((L->nc+2)*(L->mc+2),sizeof(double));
+    L->ec = (double*)calloc((L->nc+2)*(L->mc+2),sizeof(double));
+    bloque[0] = L->nc; bloque[1] = L->mc; bloque[2] = L->ac; bloque[3] = L->cc;
+    if (!rank) L->bloques = (int*)malloc(4*size*sizeof(int));
+    MPI_Gather( bloque , 4 , MPI_INT , L->bloques , 4 , MPI_INT , 0 , L->comm);
+
+    MPI_Comm solo;
+    MPI_Comm_split( L->comm , rank ? MPI_UNDEFINED : 0 , 0 , &solo);
+    C->activo = !rank;
+    if (C->activo) {
+      int dims[2] = {1,1}, periods[2] = {0,0};
+      MPI_Cart_create( solo , 2 , dims , periods , 0 , &C->comm);
+      MPI_Comm_free(&solo);
+      C->comm_propio = 1;
+      C->n = C->N; C->m = C->M; C->a = 1; C->c = 1;
+      mg_nivel_reservar(C);
+      halo_plan_topologia(&C->plan,C->n,C->m,&C->comm);
+    }
+  }
+}
+
+void mg_liberar(multigrid *mg)
+{
+  int l;
+  mg_nivel *L;
+  for (l=0; l<mg->nniveles; l++) {
+    L = &mg->niv[l];
+    if (!L->activo) continue;
+    if (l > 0) {
+      free(L->u);
+      free(L->f);
+    }
+    free(L->t);
+    free(L->r);
+    free(L->fc);
+    free(L->ec);
+    free(L->bloques);
+    MPI_Type_free( &L->plan.columna);
+    if (L->comm_propio) MPI_Comm_free(&L->comm);
+  }
+  free(mg->x0);
+}
+
+/*
+ * Última fila y columna de un nivel con frontera no alineada
+ *
+ *   fi (fj) es el índice local de la última fila (columna) global si este rank la
+ *   tiene y su hueco a la frontera es menor que un paso, o 0. Los núcleos de
+ *   jacobi_kernel.h recorren [1,n-(fi>0)]x[1,m-(fj>0)] y mg_borde el resto con el
+ *   operador no uniforme: la frontera vale 0, así que basta con la diagonal y los
+ *   vecinos interiores.
+ */
+enum MG_BORDES {MG_BORDE_POND, MG_BORDE_RESIDUO, MG_BORDE_SOR};
+
+static void mg_ultimas(const mg_nivel *L, int *fi, int *fj)
+{
+  *fi = (L->dy < 1.0 && L->a+L->n-1 == L->N) ? L->n : 0;
+  *fj = (L->dx < 1.0 && L->c+L->m-1 == L->M) ? L->m : 0;
+}
+
+/*
+ * En los puntos de la última fila y columna: Jacobi ponderado de u en t
+ * (MG_BORDE_POND), residuo de u en t (MG_BORDE_RESIDUO) o semibarrido de SOR del
+ * color dado sobre u (MG_BORDE_SOR), con w el peso o el factor de relajación.
+ */
+static void mg_borde(const mg_nivel *L, int tipo, double w, int color, double *u, double *t)
+{
+  int i, j, fi, fj, ld = L->m+2;
+  double diag, vec, *f = L->f;
+
+  mg_ultimas(L,&fi,&fj);
+  for (i=1; i<=L->n; i++) {
+    for (j=1; j<=L->m; j++) {
+      if (i != fi && j != fj) {
+        if (fj) j = fj-1;  /* salta a la última columna */
+        continue;
+      }
+      if (tipo == MG_BORDE_SOR && (i+j+color)%2) continue;
+      if (i == fi) { diag = 2.0/L->dy; vec = 2.0/(1.0+L->dy)*u[(i-1)*ld+j]; }
+      else { diag = 2.0; vec = u[(i-1)*ld+j] + u[(i+1)*ld+j]; }
+      if (j == fj) { diag += 2.0/L->dx; vec += 2.0/(1.0+L->dx)*u[i*ld+j-1]; }
+      else { diag += 2.0; vec += u[i*ld+j-1] + u[i*ld+j+1]; }
+
+      if (tipo == MG_BORDE_RESIDUO) t[i*ld+j] = f[i*ld+j] - (diag*u[i*ld+j] - vec);
+      else if (tipo == MG_BORDE_POND) t[i*ld+j] = u[i*ld+j] + w*((f[i*ld+j]+vec)/diag - u[i*ld+j]);
+      else u[i*ld+j] += w*((f[i*ld+j]+vec)/diag - u[i*ld+j]);
+    }
+  }
+}
+
+static void mg_suavizar(mg_nivel *L, int nu)
+{
+  int s, fi, fj;
+  double *tmp;
+  mg_ultimas(L,&fi,&fj);
+  for (s=0; s<nu; s++) {
+    halo_intercambio(&L->plan,L->n,L->m,L->u);
+    jacobi_kernel_pond(1,L->n-(fi>0),1,L->m-(fj>0),L->m+2,MG_W,L->u,L->f,L->t);
+    if (fi || fj) mg_borde(L,MG_BORDE_POND,MG_W,0,L->u,L->t);
+    tmp = L->u; L->u = L->t; L->t = tmp;
+  }
+}
+
+static void mg_residuo(mg_nivel *L)
+{
+  int fi, fj;
+  mg_ultimas(L,&fi,&fj);
+  residuo_kernel(1,L->n-(fi>0),1,L->m-(fj>0),L->m+2,L->u,L->f,L->r);
+  if (fi || fj) mg_borde(L,MG_BORDE_RESIDUO,0.0,0,L->u,L->r);
+}
+
+/* Ponderación completa del residuo (con halo y esquinas) sobre el bloque grueso deducido */
+static void mg_restringir(mg_nivel *L, double *fc)
+{
+  int I, J, i, j, ld = L->m+2, ldc = L->mc+2;
+  int i0 = 2*L->ac - L->a + 1, j0 = 2*L->cc - L->c + 1;
+  double *r = L->r;
+
+  for (I=1; I<=L->nc; I++) {
+    i = i0 + 2*(I-1);
+    for (J=1; J<=L->mc; J++) {
+      j = j0 + 2*(J-1);
+      fc[I*ldc+J] = 4.0*(4.0*r[i*ld+j]
+                         + 2.0*(r[(i-1)*ld+j] + r[(i+1)*ld+j] + r[i*ld+(j-1)] + r[i*ld+(j+1)])
+                         + r[(i-1)*ld+(j-1)] + r[(i-1)*ld+(j+1)] + r[(i+1)*ld+(j-1)] + r[(i+1)*ld+(j+1)])/16.0;
+    }
+  }
+}
+
+/*
+ * Interpolación bilineal de la corrección gruesa ec (con halo y esquinas) y corrección
+ * de u. Un punto fino impar está entre dos gruesos (pesos 1/2), salvo el último de
+ * una malla impar, que está entre el último grueso y la frontera, a dy pasos finos
+ * de ella: peso dy/(1+dy) para el grueso (la frontera es 0).
+ */
+static void mg_prolongar(mg_nivel *L, double *ec)
+{
+  int i, j, g, i1, i2, j1, j2, ld = L->m+2, ldc = L->mc+2;
+  double wi1, wi2, wj1, wj2;
+
+  for (i=1; i<=L->n; i++) {
+    g = L->a + i - 1;
+    i1 = g/2 - L->ac + 1;
+    i2 = (g+1)/2 - L->ac + 1;
+    wi1 = wi2 = 0.5;
+    if (g%2 && g == L->N) { wi1 = L->dy/(1.0+L->dy); wi2 = 0.0; }
+    for (j=1; j<=L->m; j++) {
+      g = L->c + j - 1;
+      j1 = g/2 - L->cc + 1;
+      j2 = (g+1)/2 - L->cc + 1;
+      wj1 = wj2 = 0.5;
+      if (g%2 && g == L->M) { wj1 = L->dx/(1.0+L->dx); wj2 = 0.0; }
+      L->u[i*ld+j] += wi1*(wj1*ec[i1*ldc+j1] + wj2*ec[i1*ldc+j2]) + wi2*(wj1*ec[i2*ldc+j1] + wj2*ec[i2*ldc+j2]);
+    }
+  }
+}
+
+/* Reúne la parte derecha gruesa de todos los ranks en el nivel aglomerado C (rank 0) */
+static void mg_aglomerar(mg_nivel *L, mg_nivel *C)
+{
+  int p, size, rank, *bl;
+  MPI_Datatype tipo;
+  MPI_Request req;
+
+  int f_previa = FASE(FASE_HALO);  /* la comunicación del nivel aglomerado cuenta como halo */
+  MPI_Comm_size(L->comm, &size);
+  MPI_Comm_rank(L->comm, &rank);
+
+  MPI_Type_vector( L->nc , L->mc , L->mc+2 , MPI_DOUBLE , &tipo);
+  MPI_Type_commit( &tipo);
+  MPI_Isend( &L->fc[1*(L->mc+2)+1] , 1 , tipo , 0 , 1 , L->comm , &req);
+  MPI_Type_free( &tipo);
+
+  if (!rank) {
+    for (p=0; p<size; p++) {
+      bl = &L->bloques[4*p];
+      MPI_Type_vector( bl[0] , bl[1] , C->m+2 , MPI_DOUBLE , &tipo);
+      MPI_Type_commit( &tipo);
+      MPI_Recv( &C->f[bl[2]*(C->m+2)+bl[3]] , 1 , tipo , p , 1 , L->comm , MPI_STATUS_IGNORE);
+      MPI_Type_free( &tipo);
+    }
+  }
+  MPI_Wait( &req , MPI_STATUS_IGNORE);
+  FASE(f_previa);
+}
+
+/* Devuelve a cada rank su ventana de la corrección gruesa, con las celdas fantasma */
+static void mg_repartir(mg_nivel *L, mg_nivel *C)
+{
+  int p, size, rank, *bl;
+  MPI_Datatype tipo;
+  MPI_Request req;
+
+  int f_previa = FASE(FASE_HALO);
+  MPI_Comm_size(L->comm, &size);
+  MPI_Comm_rank(L->comm, &rank);
+
+  MPI_Irecv( L->ec , (L->nc+2)*(L->mc+2) , MPI_DOUBLE , 0 , 2 , L->comm , &req);
+
+  if (!rank) {
+    for (p=0; p<size; p++) {
+      bl = &L->bloques[4*p];
+      MPI_Type_vector( bl[0]+2 , bl[1]+2 , C->m+2 , MPI_DOUBLE , &tipo);
+      MPI_Type_commit( &tipo);
+      MPI_Send( &C->u[(bl[2]-1)*(C->m+2)+bl[3]-1] , 1 , tipo , p , 2 , L->comm);
+      MPI_Type_free( &tipo);
+    }
+  }
+  MPI_Wait( &req , MPI_STATUS_IGNORE);
+  FASE(f_previa);
+}
+
+/* Nivel más grueso: barridos de SOR rojo-negro hasta reducir el error de forma sobrada */
+static void mg_resolver_grueso(mg_nivel *L)
+{
+  int k, color, fi, fj, nbarridos = 4*(L->N+L->M)+10;
+  double omega = sor_omega_optimo(L->N,L->M);
+
+  mg_ultimas(L,&fi,&fj);
+  for (k=0; k<nbarridos; k++) {
+    for (color=0; color<2; color++) {
+      halo_intercambio(&L->plan,L->n,L->m,L->u);
+      sor_kernel(1,L->n-(fi>0),1,L->m-(fj>0),L->m+2,(color+L->a+L->c)%2,omega,L->u,L->f);
+      if (fi || fj) mg_borde(L,MG_BORDE_SOR,omega,(color+L->a+L->c)%2,L->u,NULL);
+    }
+  }
+}
 
 /*
- * Un paso del método de Jacobi para la ecuación de Poisson
+ * Ciclo de multigrid en el nivel l (V o F). En el ciclo F la corrección gruesa se
+ * calcula con un ciclo F seguido de un ciclo V en el nivel siguiente.
+ */
+static void mg_ciclo(multigrid *mg, int l, int tipo)
+{
+  mg_nivel *L = &mg->niv[l], *C;
+  double *ec;
+
+  if (l == mg->nniveles-1) {
+    mg_resolver_grueso(L);
+    return;
+  }
+  C = &mg->niv[l+1];
+
+  mg_suavizar(L,MG_NU);
+
+  /* tras el suavizado u es el antiguo t: sus celdas fantasma no están al día */
+  halo_intercambio(&L->plan,L->n,L->m,L->u);
+  mg_residuo(L);
+  halo_intercambio(&L->plan,L->n,L->m,L->r);
+
+  mg_restringir(L, L->aglomera ? L->fc : C->f);
+  if (L->aglomera) mg_aglomerar(L,C);
+
+  if (C->activo) {
+    memset(C->u, 0, (C->n+2)*(C->m+2)*sizeof(double));
+    mg_ciclo(mg,l+1,tipo);
+    if (tipo == MG_F) mg_ciclo(mg,l+1,MG_V);
+  }
+
+  if (L->aglomera) {
+    mg_repartir(L,C);
+    ec = L->ec;
+  }
+  else {
+    halo_intercambio(&C->plan,C->n,C->m,C->u);
+    ec = C->u;
+  }
+  mg_prolongar(L,ec);
+
+  mg_suavizar(L,MG_NU);
+}
+
+/*
+ * Una iteración de multigrid sobre x (el vector del nivel fino). Devuelve la suma
+ * local de ||x_{k}-x_{k+1}||^2, como jacobi_step.
+ */
+double mg_iteracion(multigrid *mg, double *x, int tipo)
+{
+  mg_nivel *L = &mg->niv[0];
+  int i, j, ld = L->m+2;
+  double d, s = 0.0;
+
+  memcpy(mg->x0, x, (L->n+2)*(L->m+2)*sizeof(double));
+  mg_ciclo(mg,0,tipo);
+
+  /* el suavizador intercambia u y t: la solución debe quedar en x */
+  if (L->u != x) {
+    memcpy(x, L->u, (L->n+2)*(L->m+2)*sizeof(double));
+    L->t = L->u;
+    L->u = x;
+  }
+
+  for (i=1; i<=L->n; i++) {
+    for (j=1; j<=L->m; j++) {
+      d = x[i*ld+j]-mg->x0[i*ld+j];
+      s += d*d;
+    }
+  }
+  return s;
+}
+
+/*
+ * Gradiente conjugado sin matriz
  *
- *   Argumentos:
- *     - N,M: dimensiones de la malla
- *     - Entrada: x es el vector de la iteración anterior, b es la parte derecha del sistema
- *     - Salida: t es el nuevo vector
+ *   Usa el operador de 5 puntos de operador_kernel y el mismo plan de halo que
+ *   Jacobi. Se sigue la formulación de CG segmentado (Ghysels y Vanroose): los dos
+ *   productos escalares de cada iteración, (r,r) y (w,r) con w = A r, van en una sola
+ *   reducción. Con "segmentado" la reducción es un MPI_Iallreduce que se solapa con
+ *   el intercambio de halo y el producto q = A w; sin él es un MPI_Allreduce.
  *
- *   Se asume que x,b,t son de dimensión (N+2)*(M+2), se recorren solo los puntos interiores
- *   de la malla, y en los bordes están almacenadas las condiciones de frontera (por defecto 0).
+ *   La norma del paso, ||x_{k+1}-x_{k}||^2 = alpha^2 (p,p), se obtiene con la
+ *   recurrencia (p,p) = (r,r) + beta^2 (p_ant,p_ant) (r es ortogonal a p_ant), sin
+ *   otra reducción.
  */
-void jacobi_step(int N,int M,double *x,double *b,double *t, MPI_Comm *comm_cart)
+typedef struct {
+  int n, m;
+  int segmentado;
+  halo_plan *plan;
+  double *r, *w, *p, *s, *z, *q;
+  double gamma_ant, alpha_ant, pp;
+  int it;
+} cg_estado;
+
+void cg_crear(cg_estado *cg,int N,int M,double *x,double *b, halo_plan *plan, int segmentado)
 {
-  int ld = M+2;
-  int rank;
-  MPI_Comm_rank(*comm_cart, &rank);
+  int tam = (N+2)*(M+2);
 
-  // Identificamos los vecinos de la malla
+  cg->n = N;
+  cg->m = M;
+  cg->segmentado = segmentado;
+  cg->plan = plan;
+  cg->r = (double*)calloc(tam,sizeof(double));
+  cg->w = (double*)calloc(tam,sizeof(double));
+  cg->p = (double*)calloc(tam,sizeof(double));
+  cg->s = (double*)calloc(tam,sizeof(double));
+  cg->z = (double*)calloc(tam,sizeof(double));
+  cg->q = (double*)calloc(tam,sizeof(double));
+  cg->pp = 0.0;
+  cg->it = 0;
 
-  enum DIRS {DOWN, UP, LEFT, RIGHT};
-  int neighbours_ranks[4];
+  /* r = b - A x, w = A r */
+  halo_intercambio(plan,N,M,x);
+  residuo_kernel(1,N,1,M,M+2,x,b,cg->r);
+  halo_intercambio(plan,N,M,cg->r);
+  operador_kernel(1,N,1,M,M+2,cg->r,cg->w);
+}
 
-  MPI_Cart_shift( *comm_cart , 0 , 1 , &neighbours_ranks[LEFT] , &neighbours_ranks[RIGHT]);
-  MPI_Cart_shift( *comm_cart , 1 , 1 , &neighbours_ranks[DOWN] , &neighbours_ranks[UP]);
+void cg_liberar(cg_estado *cg)
+{
+  free(cg->r);
+  free(cg->w);
+  free(cg->p);
+  free(cg->s);
+  free(cg->z);
+  free(cg->q);
+}
 
-  // Creamos el tipo para cuando mandemos columnas a la derecha e izquierda
-  MPI_Datatype columna;
-  MPI_Type_vector( N , 1 , ld , MPI_DOUBLE , &columna);
-  MPI_Type_commit( &columna);
+/*
+ * Una iteración de CG sobre x. Devuelve ||x_{k}-x_{k+1}||^2 ya reducido en todos
+ * los procesos.
+ */
+double cg_iteracion(cg_estado *cg, double *x)
+{
+  int i, j, k, N = cg->n, M = cg->m, ld = M+2;
+  double rr = 0.0, wr = 0.0, local[2], global[2], gamma, delta, alpha, beta;
+  MPI_Request req;
 
-  // Envío de columnas
-  if (rank%2 == 0){
-    MPI_Send( &x[1*ld+M] , 1 , columna , neighbours_ranks[RIGHT] , 0 , *comm_cart);
-    MPI_Recv( &x[1*ld+0] , 1 , columna , neighbours_ranks[LEFT] , 0 , *comm_cart , MPI_STATUS_IGNORE);
-    MPI_Send( &x[1*ld+1] , 1 , columna , neighbours_ranks[LEFT] , 0 , *comm_cart);
-    MPI_Recv( &x[1*ld+M+1] , 1 , columna , neighbours_ranks[RIGHT] , 0 , *comm_cart , MPI_STATUS_IGNORE);
+  OMP(parallel for private(j,k) reduction(+:rr,wr) schedule(static) if(OMP_SI(1,N,1,M)))
+  for (i=1; i<=N; i++) {
+    for (j=1; j<=M; j++) {
+      k = i*ld+j;
+      rr += cg->r[k]*cg->r[k];
+      wr += cg->w[k]*cg->r[k];
+    }
   }
-  else{
-    MPI_Recv( &x[1*ld+0] , 1 , columna , neighbours_ranks[LEFT] , 0 , *comm_cart , MPI_STATUS_IGNORE);
-    MPI_Send( &x[1*ld+M] , 1 , columna , neighbours_ranks[RIGHT] , 0 , *comm_cart);
-    MPI_Recv( &x[1*ld+M+1] , 1 , columna , neighbours_ranks[RIGHT] , 0 , *comm_cart , MPI_STATUS_IGNORE);
-    MPI_Send( &x[1*ld+1] , 1 , columna , neighbours_ranks[LEFT] , 0 , *comm_cart);
+  local[0] = rr;
+  local[1] = wr;
+
+  BYTES(FASE_REDUCCION, sizeof(local));
+  if (cg->segmentado) {
+    CRONO(FASE_REDUCCION, MPI_Iallreduce( local , global , 2 , MPI_DOUBLE , MPI_SUM , cg->plan->comm , &req));
+    halo_intercambio(cg->plan,N,M,cg->w);
+    operador_kernel(1,N,1,M,ld,cg->w,cg->q);
+    CRONO(FASE_REDUCCION, MPI_Wait( &req , MPI_STATUS_IGNORE));
+  }
+  else {
+    CRONO(FASE_REDUCCION, MPI_Allreduce( local , global , 2 , MPI_DOUBLE , MPI_SUM , cg->plan->comm));
+    halo_intercambio(cg->plan,N,M,cg->w);
+    operador_kernel(1,N,1,M,ld,cg->w,cg->q);
   }
 
-  // Envío de filas
-  if (rank%2 == 0){
-    MPI_Send( &x[N*ld+1] , M , MPI_DOUBLE , neighbours_ranks[DOWN] , 0 , *comm_cart);
-    MPI_Recv( &x[0*ld+1] , M , MPI_DOUBLE , neighbours_ranks[UP] , 0 , *comm_cart , MPI_STATUS_IGNORE);
-    MPI_Send( &x[1*ld+1] , M , MPI_DOUBLE , neighbours_ranks[UP] , 0 , *comm_cart);
-    MPI_Recv( &x[(N+1)*ld+1] , M , MPI_DOUBLE , neighbours_ranks[DOWN] , 0 , *comm_cart , MPI_STATUS_IGNORE);
+  gamma = global[0];
+  delta = global[1];
+  if (gamma == 0.0) return 0.0;  /* solución exacta */
+
+  if (cg->it > 0) {
+    beta = gamma/cg->gamma_ant;
+    alpha = gamma/(delta - beta*gamma/cg->alpha_ant);
   }
-  else{
-    MPI_Recv( &x[0*ld+1] , M , MPI_DOUBLE , neighbours_ranks[UP] , 0 , *comm_cart , MPI_STATUS_IGNORE);
-    MPI_Send( &x[N*ld+1] , M , MPI_DOUBLE , neighbours_ranks[DOWN] , 0 , *comm_cart);
-    MPI_Recv( &x[(N+1)*ld+1] , M , MPI_DOUBLE , neighbours_ranks[DOWN] , 0 , *comm_cart , MPI_STATUS_IGNORE);
-    MPI_Send( &x[1*ld+1] , M , MPI_DOUBLE , neighbours_ranks[UP] , 0 , *comm_cart);
+  else {
+    beta = 0.0;
+    alpha = gamma/delta;
+  }
+  cg->pp = gamma + beta*beta*cg->pp;
+
+  OMP(parallel for private(j,k) schedule(static) if(OMP_SI(1,N,1,M)))
+  for (i=1; i<=N; i++) {
+    for (j=1; j<=M; j++) {
+      k = i*ld+j;
+      cg->z[k] = cg->q[k] + beta*cg->z[k];
+      cg->s[k] = cg->w[k] + beta*cg->s[k];
+      cg->p[k] = cg->r[k] + beta*cg->p[k];
+      x[k] += alpha*cg->p[k];
+      cg->r[k] -= alpha*cg->s[k];
+      cg->w[k] -= alpha*cg->z[k];
+    }
   }
 
-  int i, j;
+  cg->gamma_ant = gamma;
+  cg->alpha_ant = alpha;
+  cg->it++;
+  return alpha*alpha*cg->pp;
+}
+
+/*
+ * Bloqueo temporal de Jacobi con halo profundo
+ *
+ *   Las mallas llevan un halo de "prof" celdas y el intercambio (del mismo tipo que
+ *   halo_intercambio: primero columnas con un MPI_Type_vector de prof columnas y
+ *   después prof filas completas, esquinas incluidas) se hace una vez cada prof
+ *   iteraciones. En el barrido s (1..prof) se actualiza también la parte del halo
+ *   que seguirá siendo válida, que se reduce en una celda por barrido en cada lado
+ *   con vecino; en los lados con contorno físico no se sale del bloque.
+ *
+ *   Los prof barridos se hacen por franjas de filas que caben en la caché, con un
+ *   recorrido sesgado: la franja [U0,U0+H) calcula en el barrido s las filas
+ *   U0-(s-1)..U0+H-1-(s-1). Cada fila del barrido s solo depende de filas del
+ *   barrido s-1 ya calculadas (en esta franja o en las anteriores) y solo pisa en
+ *   el vector de ida y vuelta valores del barrido s-2 que ya nadie necesita, así
+ *   que bastan dos vectores como en Jacobi. Cada franja pasa prof barridos sobre la
+ *   caché antes de volver a memoria.
+ *
+ *   Los vectores se indexan como x[i*ld+j] con i en [1-prof, N+prof] y j en
+ *   [1-prof, M+prof]; el puntero apunta a la posición (0,0) del esquema habitual.
+ */
+#ifndef TB_CACHE
+#define TB_CACHE (1<<20)  /* bytes de caché disponibles para una franja */
+#endif
+
+typedef struct {
+  int n, m, prof, ld, H;
+  int ext[4];             /* 1 si hay vecino en esa dirección (el halo se amplía) */
+  halo_plan *plan;
+  MPI_Datatype columnas;  /* N filas de prof columnas */
+  double *mem[3], *v[2], *b;
+} temporal_estado;
+
+static double *tb_reservar(temporal_estado *tb, double **mem)
+{
+  int p = tb->prof;
+  *mem = (double*)calloc((size_t)(tb->n+2*p)*tb->ld,sizeof(double));
+  return *mem + (p-1)*tb->ld + (p-1);
+}
+
+/* Intercambio del halo profundo del vector x */
+static void tb_intercambio(temporal_estado *tb, double *x)
+{
+  int N = tb->n, M = tb->m, p = tb->prof, ld = tb->ld;
+  int *vec = tb->plan->vecinos;
+  MPI_Comm comm = tb->plan->comm;
+  MPI_Request reqs[4];
+  int f_previa = FASE(FASE_HALO);
+
+  BYTES(FASE_HALO, halo_bytes(tb->plan,p*ld,N*p));
+  MPI_Irecv( &x[1*ld+1-p] , 1 , tb->columnas , vec[LEFT] , 0 , comm , &reqs[0]);
+  MPI_Irecv( &x[1*ld+M+1] , 1 , tb->columnas , vec[RIGHT] , 0 , comm , &reqs[1]);
+  MPI_Isend( &x[1*ld+M-p+1] , 1 , tb->columnas , vec[RIGHT] , 0 , comm , &reqs[2]);
+  MPI_Isend( &x[1*ld+1] , 1 , tb->columnas , vec[LEFT] , 0 , comm , &reqs[3]);
+  MPI_Waitall( 4 , reqs , MPI_STATUSES_IGNORE);
+
+  MPI_Irecv( &x[(1-p)*ld+1-p] , p*ld , MPI_DOUBLE , vec[UP] , 0 , comm , &reqs[0]);
+  MPI_Irecv( &x[(N+1)*ld+1-p] , p*ld , MPI_DOUBLE , vec[DOWN] , 0 , comm , &reqs[1]);
+  MPI_Isend( &x[(N-p+1)*ld+1-p] , p*ld , MPI_DOUBLE , vec[DOWN] , 0 , comm , &reqs[2]);
+  MPI_Isend( &x[1*ld+1-p] , p*ld , MPI_DOUBLE , vec[UP] , 0 , comm , &reqs[3]);
+  MPI_Waitall( 4 , reqs , MPI_STATUSES_IGNORE);
+  FASE(f_previa);
+}
+
+/*
+ * Prepara el bloqueo temporal de profundidad prof (recortada al menor bloque de la
+ * malla) a partir de x y b. Devuelve la profundidad usada.
+ */
+int temporal_crear(temporal_estado *tb,int N,int M,double *x,double *b, halo_plan *plan, int prof)
+{
+  int i, j, minimo, global, ld0 = M+2;
+
+  minimo = (N < M) ? N : M;
+  MPI_Allreduce( &minimo , &global , 1 , MPI_INT , MPI_MIN , plan->comm);
+  if (prof > global) prof = global;
+
+  tb->n = N;
+  tb->m = M;
+  tb->prof = prof;
+  tb->ld = M+2*prof;
+  tb->plan = plan;
+  tb->ext[UP] = (plan->vecinos[UP] != MPI_PROC_NULL);
+  tb->ext[DOWN] = (plan->vecinos[DOWN] != MPI_PROC_NULL);
+  tb->ext[LEFT] = (plan->vecinos[LEFT] != MPI_PROC_NULL);
+  tb->ext[RIGHT] = (plan->vecinos[RIGHT] != MPI_PROC_NULL);
+
+  /* franja: H filas más las prof+2 que arrastra el sesgo, en x, t y b */
+  tb->H = TB_CACHE/(3*(int)sizeof(double)*tb->ld) - prof - 2;
+  if (tb->H < 1) tb->H = 1;
+
+  MPI_Type_vector( N , prof , tb->ld , MPI_DOUBLE , &tb->columnas);
+  MPI_Type_commit( &tb->columnas);
+
+  tb->v[0] = tb_reservar(tb,&tb->mem[0]);
+  tb->v[1] = tb_reservar(tb,&tb->mem[1]);
+  tb->b = tb_reservar(tb,&tb->mem[2]);
   for (i=1; i<=N; i++) {
     for (j=1; j<=M; j++) {
-      t[i*ld+j] = (b[i*ld+j] + x[(i+1)*ld+j] + x[(i-1)*ld+j] + x[i*ld+(j+1)] + x[i*ld+(j-1)])/4.0;
+      tb->v[0][i*tb->ld+j] = x[i*ld0+j];
+      tb->b[i*tb->ld+j] = b[i*ld0+j];
+    }
+  }
+  tb_intercambio(tb,tb->b);
+  return prof;
+}
+
+/* Copia el iterado actual a x, con el esquema habitual de (N+2)*(M+2) */
+void temporal_extraer(temporal_estado *tb, double *x)
+{
+  int i, j, ld0 = tb->m+2;
+  for (i=1; i<=tb->n; i++)
+    for (j=1; j<=tb->m; j++)
+      x[i*ld0+j] = tb->v[0][i*tb->ld+j];
+}
+
+void temporal_liberar(temporal_estado *tb)
+{
+  MPI_Type_free( &tb->columnas);
+  free(tb->mem[0]);
+  free(tb->mem[1]);
+  free(tb->mem[2]);
+}
+
+/*
+ * Filas i0..i1 del barrido de x a t sobre las columnas j0..j1. Devuelve la suma de
+ * (x-t)^2 solo sobre los puntos propios (filas 1..N, columnas 1..M); el resto es
+ * halo recalculado.
+ */
+static double tb_filas(temporal_estado *tb,int i0,int i1,int j0,int j1,const double *x,double *t)
+{
+  int N = tb->n, M = tb->m, ld = tb->ld;
+  int a = (i0 > 1) ? i0 : 1, z = (i1 < N) ? i1 : N;
+  double s = 0.0;
+
+  /* halo de arriba, filas propias y halo de abajo */
+  if (i0 <= 0) jacobi_kernel(i0,(i1 < 0) ? i1 : 0,j0,j1,ld,x,tb->b,t);
+  if (a <= z) {
+    if (j0 < 1) jacobi_kernel(a,z,j0,0,ld,x,tb->b,t);
+    s = jacobi_kernel(a,z,1,M,ld,x,tb->b,t);
+    if (j1 > M) jacobi_kernel(a,z,M+1,j1,ld,x,tb->b,t);
+  }
+  if (i1 > N) jacobi_kernel((i0 > N+1) ? i0 : N+1,i1,j0,j1,ld,x,tb->b,t);
+  return s;
+}
+
+/*
+ * nb barridos (nb <= prof) con un solo intercambio de halo. En norma[s] queda la
+ * suma local de ||x_{k}-x_{k+1}||^2 de cada barrido.
+ */
+void temporal_bloque(temporal_estado *tb, int nb, double *norma)
+{
+  int s, u, r, i0, i1, j0, j1, lo, hi, N = tb->n, M = tb->m;
+  double *tmp;
+
+  tb_intercambio(tb,tb->v[0]);
+  for (s=0; s<nb; s++) norma[s] = 0.0;
+
+  lo = 1 - tb->ext[UP]*(nb-1);
+  hi = N + nb-1;
+  for (u=lo; u<=hi; u+=tb->H) {
+    for (s=1; s<=nb; s++) {
+      r = nb-s;  /* celdas de halo que siguen siendo válidas tras este barrido */
+      i0 = u-(s-1);
+      i1 = u+tb->H-1-(s-1);
+      if (i0 < 1-tb->ext[UP]*r) i0 = 1-tb->ext[UP]*r;
+      if (i1 > N+tb->ext[DOWN]*r) i1 = N+tb->ext[DOWN]*r;
+      if (i0 > i1) continue;
+      j0 = 1-tb->ext[LEFT]*r;
+      j1 = M+tb->ext[RIGHT]*r;
+      norma[s-1] += tb_filas(tb,i0,i1,j0,j1,tb->v[(s-1)%2],tb->v[s%2]);
+    }
+  }
+
+  /* el iterado queda siempre en v[0] */
+  if (nb%2) {
+    tmp = tb->v[0]; tb->v[0] = tb->v[1]; tb->v[1] = tmp;
+  }
+}
+
+/*
+ * Revisa una ventana de normas ya reducidas
+ *
+ *   suma[0..n-1] contiene ||x_{k}-x_{k+1}||^2 de las iteraciones base..base+n-1. Si
+ *   imprime es distinto de 0 (el máster, fuera del modo --bench) se imprime el error de
+ *   cada una hasta la primera que cumple el criterio de parada, cuyo número se deja
+ *   en k_conv. En *ultimo queda el último error revisado.
+ *   Devuelve 1 si alguna ha convergido.
+ */
+static int revisar_ventana(double *suma, int n, int base, double tol, int imprime, int *k_conv, double *ultimo)
+{
+  int i;
+  for (i=0; i<n; i++) {
+    *ultimo = sqrt(suma[i]);
+    if (imprime){
+      printf("Error en iteración %d: %g\n", base+i, sqrt(suma[i]));
+    }
+    if (sqrt(suma[i])<tol) {
+      *k_conv = base+i;
+      return 1;
     }
   }
+  return 0;
 }
 
 /*
@@ -84,93 +1377,600 @@ void jacobi_step(int N,int M,double *x,double *b,double *t, MPI_Comm *comm_cart)
  *
  *   Suponemos que las condiciones de contorno son igual a 0 en toda la
  *   frontera del dominio.
+ *
+ *   Política de convergencia: cada rank guarda su norma local de las últimas
+ *   op->intervalo iteraciones y se reducen todas juntas cada op->intervalo
+ *   iteraciones, de modo que se sabe exactamente en qué iteración se alcanzó la
+ *   tolerancia. Con op->asincrona la reducción es un MPI_Iallreduce que se completa
+ *   después del barrido siguiente, y la decisión de parar llega con una iteración de
+ *   retraso. En ambos casos se informa de las iteraciones extra realizadas.
+ *
+ *   Con op->metodo == METODO_SOR se usa SOR rojo-negro en lugar de Jacobi, y con
+ *   METODO_MG_V/METODO_MG_F cada iteración es un ciclo V/F de multigrid. Con
+ *   METODO_CG/METODO_CG_SEGMENTADO se usa gradiente conjugado (con reducción bloqueante o
+ *   segmentada); la norma del paso ya viaja en su única reducción por iteración, así
+ *   que en ese caso no se aplica la política de convergencia.
+ *
+ *   Con op->prof > 1 y Jacobi se usa el bloqueo temporal (ver temporal_bloque): un
+ *   intercambio de halo y una reducción de las normas cada op->prof iteraciones.
+ *
+ *   Con op->checkpoint se escribe un checkpoint cada op->cada iteraciones (ver
+ *   poisson_io.h), que se solapa con las iteraciones siguientes. Con op->reanudar se
+ *   carga antes de empezar y se sigue desde la iteración guardada. Las normas de la
+ *   ventana aún sin reducir no se guardan: tras reanudar se comprueban las
+ *   iteraciones nuevas. En gradiente conjugado solo se guarda x, así que al reanudar
+ *   las recurrencias empiezan de nuevo desde ese x.
+ *
+ *   Ng,Mg son las dimensiones de la malla global; x y b son el bloque local que
+ *   asigna bloque_global a este proceso, con su halo. Devuelve el número de
+ *   iteraciones realizadas.
+ *
+ *   Tiempos (poisson_tiempos.h): dentro del bucle la fase por defecto es el barrido;
+ *   los intercambios de halo (también los del multigrid, el gradiente conjugado y el
+ *   bloqueo temporal), las reducciones y las copias de la malla se cargan a su fase.
  */
-void jacobi_poisson(int N,int M,double *x,double *b, MPI_Comm * comm_cart)
+int jacobi_poisson(int Ng,int Mg,double *x,double *b, MPI_Comm * comm_cart, const opciones *op)
 {
+  int f_previa = FASE(FASE_PREPARACION);
+  int N, M, fila0, col0;
+  bloque_global(comm_cart,Ng,Mg,&N,&M,&fila0,&col0);
+
   int i, j, k, ld=M+2, conv, maxit=10000;
-  double *t, local_s, total_s, tol=1e-6;
+  double *t, *xk, *xn, *tmp, local_s, total_s, tol=1e-6;
+  double *ventana, *envio, *suma;
+  int nv = 0, pendiente = 0, base_pend = 0, n_pend = 0, k_conv = -1;
+  double ultimo = 0.0;
+  MPI_Request req_conv = MPI_REQUEST_NULL;
 
-  t = (double*)calloc((N+2)*(M+2),sizeof(double));
+  t = malla_reservar(N,ld);
+  xk = x;
+  xn = t;
+
+  ventana = (double*)calloc(op->intervalo+op->prof,sizeof(double));
+  envio = (double*)calloc(op->intervalo,sizeof(double));
+  suma = (double*)calloc(op->intervalo+op->prof,sizeof(double));
 
   k = 0;
   conv = 0;
 
   int rank;
   MPI_Comm_rank(*comm_cart, &rank);
+  int imprime = !rank && !op->bench;
 
-  while (!conv && k<maxit) {
+  /* la memoria compartida solo se aplica a los métodos que trabajan sobre x y t */
+  int modo = op->halo;
+  if (modo == HALO_COMPARTIDO && !(op->metodo == METODO_SOR || (op->metodo == METODO_JACOBI && op->prof <= 1))) {
+    if (!rank) fprintf(stderr, "Aviso: el halo en memoria compartida solo se aplica a Jacobi y SOR\n");
+    modo = HALO_BLOQUEANTE;
+  }
 
-    /* calcula siguiente vector */
-    jacobi_step(N,M,x,b,t, comm_cart);
+  halo_plan plan;
+  halo_plan_crear(&plan,N,M,x,t,comm_cart,modo);
+  plan.en_sitio = (op->metodo == METODO_SOR);
+  if (modo == HALO_COMPARTIDO) halo_plan_compartido(&plan,N,M,&xk,&xn);
+  if (modo == HALO_RMA) halo_plan_rma(&plan,N,M,x,t);
 
-    /* criterio de parada: ||x_{k}-x_{k+1}||<tol */
-    local_s = 0.0;
-    for (i=1; i<=N; i++) {
-      for (j=1; j<=M; j++) {
-        local_s += (x[i*ld+j]-t[i*ld+j])*(x[i*ld+j]-t[i*ld+j]);
+  /* posición global del bloque: paridad para la coloración rojo-negro y niveles del multigrid */
+  int desp;
+  desp = (fila0-1 + col0-1)%2;
+
+  /* checkpoints: lectura del estado guardado y escritura periódica */
+  checkpoint chk;
+  if (op->checkpoint) {
+    if (op->reanudar) {
+      if (!checkpoint_leer(op->checkpoint,*comm_cart,Ng,Mg,N,M,fila0-1,col0-1,x,&k,&ultimo)) {
+        if (imprime) printf("Reanudando desde la iteración %d (error %g)\n", k, ultimo);
+      }
+      else if (!rank) fprintf(stderr, "Aviso: no se puede leer el checkpoint %s, se empieza desde cero\n", op->checkpoint);
+    }
+    checkpoint_crear(&chk,op->checkpoint,*comm_cart,Ng,Mg,N,M,fila0-1,col0-1);
+  }
+  if (xk != x) memcpy(xk, x, (N+2)*(M+2)*sizeof(double));
+
+  multigrid mg;
+  int mg_activo = (op->metodo == METODO_MG_V || op->metodo == METODO_MG_F);
+  if (mg_activo) {
+    mg_crear(&mg,N,M,fila0,col0,Ng,Mg,x,b,comm_cart);
+    if (imprime) printf("Multigrid con %d niveles (malla más gruesa %dx%d)\n", mg.nniveles,
+                        mg.niv[mg.nniveles-1].N, mg.niv[mg.nniveles-1].M);
+  }
+
+  cg_estado cg;
+  int cg_activo = (op->metodo == METODO_CG || op->metodo == METODO_CG_SEGMENTADO);
+  if (cg_activo) cg_crear(&cg,N,M,x,b,&plan,op->metodo == METODO_CG_SEGMENTADO);
+
+  temporal_estado tb;
+  int nb, tb_activo = (op->prof > 1 && op->metodo == METODO_JACOBI);
+  if (tb_activo) {
+    nb = temporal_crear(&tb,N,M,x,b,&plan,op->prof);
+    if (imprime) printf("Bloqueo temporal con profundidad %d\n", nb);
+  }
+  else if (op->prof > 1 && !rank) fprintf(stderr, "Aviso: el bloqueo temporal solo se aplica a Jacobi\n");
+
+  int proximo_chk = (k/op->cada+1)*op->cada;
+  FASE(FASE_BARRIDO);
+  while (!conv && k<maxit) {
+
+    if (op->checkpoint) {
+      if (k >= proximo_chk) {
+        if (tb_activo) temporal_extraer(&tb,xk);
+        CRONO(FASE_COPIA, checkpoint_escribir(&chk,xk,k,ultimo));
+        proximo_chk = (k/op->cada+1)*op->cada;
       }
+      else checkpoint_progreso(&chk);
+    }
+
+    if (tb_activo) {
+      nb = (maxit-k < tb.prof) ? maxit-k : tb.prof;
+      temporal_bloque(&tb,nb,ventana);
+      BYTES(FASE_REDUCCION, nb*sizeof(double));
+      CRONO(FASE_REDUCCION, MPI_Allreduce( ventana , suma , nb , MPI_DOUBLE , MPI_SUM , *comm_cart));
+      conv = revisar_ventana(suma,nb,k,tol,imprime,&k_conv,&ultimo);
+      k = k+nb;
+      continue;
+    }
+
+    if (cg_activo) {
+      total_s = cg_iteracion(&cg,xk);
+      conv = revisar_ventana(&total_s,1,k,tol,imprime,&k_conv,&ultimo);
+      k = k+1;
+      continue;
     }
 
-    MPI_Allreduce( &local_s , &total_s , 1 , MPI_DOUBLE , MPI_SUM , *comm_cart);
-    conv = (sqrt(total_s)<tol);
+    /* calcula siguiente vector y, en el mismo recorrido, el criterio de parada: ||x_{k}-x_{k+1}||<tol */
+    if (op->metodo == METODO_SOR) {
+      local_s = sor_step(N,M,xk,b,&plan,op->omega,desp);
+    }
+    else if (mg_activo) {
+      local_s = mg_iteracion(&mg,xk,(op->metodo == METODO_MG_F) ? MG_F : MG_V);
+    }
+    else {
+      local_s = jacobi_step(N,M,xk,b,xn,&plan);
+      /* x y t intercambian sus papeles, sin copiar la malla */
+      tmp = xk; xk = xn; xn = tmp;
+      plan.actual = 1-plan.actual;
+    }
+    ventana[nv++] = local_s;
 
-    if (!rank){
-      printf("Error en iteración %d: %g\n", k, sqrt(total_s));
+    /* la reducción lanzada en la comprobación anterior se ha solapado con este barrido */
+    if (pendiente) {
+      CRONO(FASE_REDUCCION, MPI_Wait( &req_conv , MPI_STATUS_IGNORE));
+      pendiente = 0;
+      conv = revisar_ventana(suma,n_pend,base_pend,tol,imprime,&k_conv,&ultimo);
     }
 
     /* siguiente iteración */
     k = k+1;
+
+    /* comprobación de la convergencia cada op->intervalo iteraciones (y siempre en la última) */
+    if (!conv && (nv == op->intervalo || k == maxit)) {
+      if (op->asincrona && k < maxit) {
+        memcpy(envio, ventana, nv*sizeof(double));
+        BYTES(FASE_REDUCCION, nv*sizeof(double));
+        CRONO(FASE_REDUCCION, MPI_Iallreduce( envio , suma , nv , MPI_DOUBLE , MPI_SUM , *comm_cart , &req_conv));
+        pendiente = 1;
+        n_pend = nv;
+        base_pend = k-nv;
+      }
+      else {
+        BYTES(FASE_REDUCCION, nv*sizeof(double));
+        CRONO(FASE_REDUCCION, MPI_Allreduce( ventana , suma , nv , MPI_DOUBLE , MPI_SUM , *comm_cart));
+        conv = revisar_ventana(suma,nv,k-nv,tol,imprime,&k_conv,&ultimo);
+      }
+      nv = 0;
+    }
+
+  }
+
+  if (imprime && (op->intervalo > 1 || op->asincrona || tb_activo)){
+    if (conv) printf("Convergencia en la iteración %d, iteraciones extra: %d\n", k_conv, k-1-k_conv);
+    else printf("Sin convergencia tras %d iteraciones\n", k);
+  }
+
+  /* la solución queda en xk; si es el vector auxiliar se copia a x una sola vez */
+  FASE(FASE_COPIA);
+  if (xk != x) {
     for (i=1; i<=N; i++) {
       for (j=1; j<=M; j++) {
-        x[i*ld+j] = t[i*ld+j];
+        x[i*ld+j] = xk[i*ld+j];
+      }
+    }
+  }
+
+  if (mg_activo) mg_liberar(&mg);
+  if (cg_activo) cg_liberar(&cg);
+  if (op->checkpoint) checkpoint_liberar(&chk);
+  if (tb_activo) {
+    temporal_extraer(&tb,x);
+    temporal_liberar(&tb);
+  }
+  FASE(FASE_PREPARACION);
+  halo_plan_liberar(&plan);
+  malla_liberar(t);
+  free(ventana);
+  free(envio);
+  free(suma);
+  FASE(f_previa);
+  return k;
+}
+
+/*
+ * Calibración de la red
+ *
+ *   Ping-pong entre el proceso 0 de comm y el primero de otro nodo (agrupando con
+ *   MPI_Comm_split_type como en reordenar_por_nodos), que es el enlace que domina el
+ *   coste del halo; si todos están en un nodo, con el proceso 1. Un double para la
+ *   latencia alfa y
+ *   K doubles, contiguos y con separación de una línea de caché (como una columna
+ *   del halo), para los costes por elemento beta y beta_col. K es la cara más
+ *   larga de la malla, limitada para que el buffer no crezca con la malla. El
+ *   resultado se difunde a todos los procesos. Devuelve 1 si el enlace medido es
+ *   entre nodos.
+ */
+#define CALIBRA_REP 50
+#define CALIBRA_SALTO 8
+
+int calibrar_red(MPI_Comm comm,int K,double *alfa,double *beta,double *beta_col)
+{
+  int r, rank, size, otro, tipo, lider, candidato, entre_nodos;
+  double t0 = 0.0, tiempos[3], *buf;
+  MPI_Datatype dispersa, tipos[3];
+  int cuentas[3] = {1, K, 1};
+
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+
+  /* pareja del proceso 0: el menor rank cuyo nodo no contiene al proceso 0 */
+  MPI_Comm comm_nodo;
+  MPI_Comm_split_type( comm , MPI_COMM_TYPE_SHARED , rank , MPI_INFO_NULL , &comm_nodo);
+  MPI_Allreduce( &rank , &lider , 1 , MPI_INT , MPI_MIN , comm_nodo);
+  MPI_Comm_free( &comm_nodo);
+  candidato = lider ? rank : size;
+  MPI_Allreduce( &candidato , &otro , 1 , MPI_INT , MPI_MIN , comm);
+  entre_nodos = (otro < size);
+  if (!entre_nodos) otro = 1;
+
+  if (K > 1<<14) K = 1<<14;
+  cuentas[1] = K;
+  buf = (double*)calloc((size_t)K*CALIBRA_SALTO, sizeof(double));
+  MPI_Type_vector( K , 1 , CALIBRA_SALTO , MPI_DOUBLE , &dispersa);
+  MPI_Type_commit( &dispersa);
+  tipos[0] = MPI_DOUBLE; tipos[1] = MPI_DOUBLE; tipos[2] = dispersa;
+
+  for (tipo=0; tipo<3; tipo++) {
+    tiempos[tipo] = 0.0;
+    if (rank && rank != otro) continue;
+    for (r=-1; r<CALIBRA_REP; r++) {  /* r = -1: calentamiento, no se mide */
+      if (r == 0) t0 = MPI_Wtime();
+      if (!rank) {
+        MPI_Send( buf , cuentas[tipo] , tipos[tipo] , otro , 0 , comm);
+        MPI_Recv( buf , cuentas[tipo] , tipos[tipo] , otro , 0 , comm , MPI_STATUS_IGNORE);
+      }
+      else {
+        MPI_Recv( buf , cuentas[tipo] , tipos[tipo] , 0 , 0 , comm , MPI_STATUS_IGNORE);
+        MPI_Send( buf , cuentas[tipo] , tipos[tipo] , 0 , 0 , comm);
       }
     }
+    tiempos[tipo] = (MPI_Wtime()-t0)/(2*CALIBRA_REP);
+  }
+  MPI_Bcast( tiempos , 3 , MPI_DOUBLE , 0 , comm);
+
+  *alfa = tiempos[0];
+  *beta = (tiempos[1]-tiempos[0])/K;
+  *beta_col = (tiempos[2]-tiempos[0])/K;
+  if (*beta < 0.0) *beta = 0.0;
+  if (*beta_col < *beta) *beta_col = *beta;
+
+  MPI_Type_free( &dispersa);
+  free(buf);
+  return entre_nodos;
+}
+
+/*
+ * Elección de la malla de procesos
+ *
+ *   dims[0] es el número de bloques de columnas y dims[1] el de bloques de filas,
+ *   como en MPI_Cart_create. DESC_FILAS y DESC_COLUMNAS son los repartos en una
+ *   dimensión de poisson_completo.c y poisson_paralelo_horizontal.c, DESC_2D el de
+ *   MPI_Dims_create. Con DESC_AUTO se prueban todas las factorizaciones de P y se
+ *   elige la de menor coste del halo por iteración para el bloque más grande:
+ *   dos filas de m elementos si hay más de un bloque de filas y dos columnas de n
+ *   elementos (no contiguas) si hay más de uno de columnas, cada mensaje con coste
+ *   alfa + elementos*beta. Devuelve el coste estimado (0 si no es DESC_AUTO) y en
+ *   *entre_nodos si la red se calibró entre nodos (ver calibrar_red).
+ */
+double elegir_descomposicion(int desc,int N,int M,int P, MPI_Comm comm,int *dims,int *entre_nodos)
+{
+  int px, py, n, m;
+  double alfa, beta, beta_col, coste, mejor = -1.0;
+
+  dims[0] = dims[1] = 0;
+  *entre_nodos = 0;
+  if (desc == DESC_FILAS) { dims[0] = 1; dims[1] = P; }
+  if (desc == DESC_COLUMNAS) { dims[0] = P; dims[1] = 1; }
+  if (desc != DESC_AUTO) {
+    MPI_Dims_create( P , 2 , dims);
+    return 0.0;
+  }
+
+  alfa = beta = beta_col = 0.0;
+  if (P > 1) *entre_nodos = calibrar_red(comm,(N > M) ? N : M,&alfa,&beta,&beta_col);
+
+  for (px=1; px<=P; px++) {
+    if (P%px) continue;
+    py = P/px;
+    if (py > N || px > M) continue;
+    n = (N+py-1)/py;
+    m = (M+px-1)/px;
+    coste = (py > 1)*2*(alfa + m*beta) + (px > 1)*2*(alfa + n*beta_col);
+    if (mejor < 0.0 || coste < mejor) {
+      mejor = coste;
+      dims[0] = px;
+      dims[1] = py;
+    }
+  }
+  /* ninguna cabe en la malla: se deja que main informe del error */
+  if (mejor < 0.0) MPI_Dims_create( P , 2 , dims);
+  return mejor;
+}
+
+/*
+ * Reordenación de los procesos por nodos (--reorder=node)
+ *
+ *   MPI_Cart_create con reorder=1 no suele cambiar nada, así que el reparto se hace
+ *   aquí. Los procesos de cada nodo (MPI_Comm_split_type con MPI_COMM_TYPE_SHARED)
+ *   ocupan una tesela tx x ty de la malla de procesos, y de todas las teselas que
+ *   dividen a dims se elige la que deja menos elementos del halo entre nodos: cada
+ *   corte entre bloques de columnas cruza dims[1] caras de n elementos y cada corte
+ *   entre bloques de filas dims[0] caras de m. Los rangos de *comm_perm son los del
+ *   comunicador cartesiano (coordenadas en orden de filas), que se crea sobre él con
+ *   reorder=0. Si los nodos no tienen todos el mismo número de procesos o ninguna
+ *   tesela cabe, los procesos se ordenan por nodo, que al menos deja en el mismo
+ *   nodo los consecutivos en dims[1]. Devuelve el número de nodos y en tesela el
+ *   tamaño elegido (0x0 si no hay tesela).
+ */
+int reordenar_por_nodos(MPI_Comm comm,int N,int M,const int *dims,int *tesela, MPI_Comm *comm_perm)
+{
+  int rank, local, q, nodo, nnodos, datos[4], tx, ty, ncx, ncy, cx, cy, clave;
+  int px = dims[0], py = dims[1], n = (N+py-1)/py, m = (M+px-1)/px;
+  double coste, mejor = -1.0;
+  MPI_Comm comm_nodo, comm_lideres;
+
+  MPI_Comm_rank( comm , &rank);
+  MPI_Comm_split_type( comm , MPI_COMM_TYPE_SHARED , rank , MPI_INFO_NULL , &comm_nodo);
+  MPI_Comm_rank( comm_nodo , &local);
+  MPI_Comm_size( comm_nodo , &q);
 
+  /* los líderes (rank 0 de cada nodo) numeran los nodos y calculan su primer rango
+     en el orden por nodos y si todos los nodos tienen q procesos */
+  MPI_Comm_split( comm , local ? MPI_UNDEFINED : 0 , rank , &comm_lideres);
+  if (!local) {
+    int min_max[2] = {-q, q};
+    MPI_Comm_rank( comm_lideres , &datos[0]);
+    MPI_Comm_size( comm_lideres , &datos[1]);
+    datos[2] = 0;
+    MPI_Exscan( &q , &datos[2] , 1 , MPI_INT , MPI_SUM , comm_lideres);
+    if (!datos[0]) datos[2] = 0;  /* MPI_Exscan deja indefinido el del rank 0 */
+    MPI_Allreduce( MPI_IN_PLACE , min_max , 2 , MPI_INT , MPI_MAX , comm_lideres);
+    datos[3] = (-min_max[0] == min_max[1]);
+    MPI_Comm_free( &comm_lideres);
+  }
+  MPI_Bcast( datos , 4 , MPI_INT , 0 , comm_nodo);
+  MPI_Comm_free( &comm_nodo);
+  nodo = datos[0];
+  nnodos = datos[1];
+
+  tesela[0] = tesela[1] = 0;
+  if (datos[3]) {
+    for (tx=1; tx<=px; tx++) {
+      if (px%tx || q%tx || py%(q/tx)) continue;
+      ty = q/tx;
+      coste = (double)(px/tx-1)*py*n + (double)(py/ty-1)*px*m;
+      if (mejor < 0.0 || coste < mejor) {
+        mejor = coste;
+        tesela[0] = tx;
+        tesela[1] = ty;
+      }
+    }
   }
 
-  free(t);
+  if (mejor < 0.0) clave = datos[2] + local;
+  else {
+    /* tesela del nodo en la malla de teselas y posición del proceso dentro de ella,
+       ambas en orden de filas como las coordenadas cartesianas */
+    tx = tesela[0];
+    ty = tesela[1];
+    ncy = py/ty;
+    ncx = nodo/ncy;
+    cx = ncx*tx + local/ty;
+    cy = (nodo%ncy)*ty + local%ty;
+    clave = cx*py + cy;
+  }
+  MPI_Comm_split( comm , 0 , clave , comm_perm);
+  return nnodos;
 }
 
+/*
+ * Uso: mpiexec ./poisson_top_cartesiana [N] [M] [opciones]
+ *
+ *   --method=jacobi|sor|mg-v|mg-f|cg|cg-pipe
+ *                        Jacobi (por defecto), SOR rojo-negro, multigrid con ciclos
+ *                        V o F, gradiente conjugado o gradiente conjugado segmentado
+ *                        (pipelined, con la reducción solapada; sin precondicionador)
+ *   --omega=w            factor de relajación de SOR (por defecto el óptimo)
+ *   --halo=blocking|overlap|shared|rma|neighbor|neighbor-overlap
+ *                        intercambio de halo; solo Jacobi y SOR lo usan: multigrid y
+ *                        gradiente conjugado tienen su propio intercambio y rechazan
+ *                        cualquier modo que no sea blocking
+ *   --decomp=2d|rows|cols|auto, --reorder=node|mpi|none
+ *                        malla de procesos y asignación de los procesos a ella
+ *   --check=k, --conv=sync|async, --temporal=p
+ *                        política de convergencia y bloqueo temporal (Jacobi)
+ *   --checkpoint=f, --checkpoint-every=k, --restart, --output=f
+ *   --timing, --bench=csv|json
+ *                        tiempos por fase (poisson_tiempos.h)
+ */
 int main(int argc, char **argv)
 {
-  int i, j, N=40, M=40, ld;
+  int i, j, N=40, M=40, ld, npos=0;
   double *x, *b, *sol, h=0.01, f=1.5;
+  opciones op = {METODO_JACOBI, 0.0, HALO_BLOQUEANTE, 1, 0, NULL, 100, 0, 1, FORMATO_NINGUNO};
+  const char *salida = NULL;
+  int desc = DESC_2D;
+  int orden = REORDEN_NODOS;
+  char variante[512];
+  /* la variante empieza por el nombre del ejecutable, que bench_escalado.sh usa para
+     reconocer la línea del registro */
+  const char *programa = strrchr(argv[0], '/') ? strrchr(argv[0], '/')+1 : argv[0];
+  snprintf(variante, 256, "%s", programa);
+  int resumen = 0;
 
-  /* Extracción de argumentos */
-  if (argc > 1) { /* El usuario ha indicado el valor de N */
-    if ((N = atoi(argv[1])) < 0) N = 40;
-  }
-  if (argc > 2) { /* El usuario ha indicado el valor de M */
-    if ((M = atoi(argv[2])) < 0) M = 1;
+  /* Extracción de argumentos: N y M posicionales, opciones con "--" */
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "--halo=overlap")) op.halo = HALO_SOLAPADO;
+    else if (!strcmp(argv[i], "--halo=blocking")) op.halo = HALO_BLOQUEANTE;
+    else if (!strcmp(argv[i], "--halo=shared")) op.halo = HALO_COMPARTIDO;
+    else if (!strcmp(argv[i], "--halo=rma")) op.halo = HALO_RMA;
+    else if (!strcmp(argv[i], "--halo=neighbor")) op.halo = HALO_VECINDAD;
+    else if (!strcmp(argv[i], "--halo=neighbor-overlap")) op.halo = HALO_VECINDAD_SOLAPADO;
+    else if (!strncmp(argv[i], "--check=", 8)) {
+      if ((op.intervalo = atoi(argv[i]+8)) < 1) op.intervalo = 1;
+    }
+    else if (!strcmp(argv[i], "--timing")) resumen = 1;
+    else if (!strcmp(argv[i], "--bench=csv")) op.bench = FORMATO_CSV;
+    else if (!strcmp(argv[i], "--bench=json")) op.bench = FORMATO_JSON;
+    else if (!strcmp(argv[i], "--decomp=auto")) desc = DESC_AUTO;
+    else if (!strcmp(argv[i], "--decomp=rows")) desc = DESC_FILAS;
+    else if (!strcmp(argv[i], "--decomp=cols")) desc = DESC_COLUMNAS;
+    else if (!strcmp(argv[i], "--decomp=2d")) desc = DESC_2D;
+    else if (!strcmp(argv[i], "--reorder=node")) orden = REORDEN_NODOS;
+    else if (!strcmp(argv[i], "--reorder=mpi")) orden = REORDEN_MPI;
+    else if (!strcmp(argv[i], "--reorder=none")) orden = REORDEN_NINGUNO;
+    else if (!strcmp(argv[i], "--conv=async")) op.asincrona = 1;
+    else if (!strcmp(argv[i], "--conv=sync")) op.asincrona = 0;
+    else if (!strcmp(argv[i], "--method=sor")) op.metodo = METODO_SOR;
+    else if (!strcmp(argv[i], "--method=jacobi")) op.metodo = METODO_JACOBI;
+    else if (!strcmp(argv[i], "--method=mg-v")) op.metodo = METODO_MG_V;
+    else if (!strcmp(argv[i], "--method=mg-f")) op.metodo = METODO_MG_F;
+    else if (!strcmp(argv[i], "--method=cg")) op.metodo = METODO_CG;
+    else if (!strcmp(argv[i], "--method=cg-pipe")) op.metodo = METODO_CG_SEGMENTADO;
+    else if (!strncmp(argv[i], "--omega=", 8)) op.omega = atof(argv[i]+8);  /* "auto" -> 0 */
+    else if (!strncmp(argv[i], "--output=", 9)) salida = argv[i]+9;
+    else if (!strncmp(argv[i], "--checkpoint=", 13)) op.checkpoint = argv[i]+13;
+    else if (!strncmp(argv[i], "--checkpoint-every=", 19)) {
+      if ((op.cada = atoi(argv[i]+19)) < 1) op.cada = 100;
+    }
+    else if (!strcmp(argv[i], "--restart")) op.reanudar = 1;
+    else if (!strncmp(argv[i], "--temporal=", 11)) {
+      if ((op.prof = atoi(argv[i]+11)) < 1) op.prof = 1;
+    }
+    else if (npos == 0) { /* El usuario ha indicado el valor de N */
+      if ((N = atoi(argv[i])) < 0) N = 40;
+      npos++;
+    }
+    else if (npos == 1) { /* El usuario ha indicado el valor de M */
+      if ((M = atoi(argv[i])) < 0) M = 1;
+      npos++;
+    }
+    /* la variante del registro de tiempos son las opciones del solver */
+    if (!strncmp(argv[i], "--", 2) && strncmp(argv[i], "--bench=", 8) && strncmp(argv[i], "--output=", 9)
+        && strcmp(argv[i], "--timing")
+        && strlen(variante)+strlen(argv[i])+2 < sizeof(variante)) {
+      strcat(variante, " ");
+      strcat(variante, argv[i]);
+    }
   }
 
 
-  MPI_Init( &argc , &argv);
-  
+  /* Modo híbrido: solo el hilo maestro llama a MPI, fuera de las regiones paralelas
+     de los núcleos (jacobi_kernel.h), así que basta con MPI_THREAD_FUNNELED */
+  int provisto;
+  MPI_Init_thread( &argc , &argv , MPI_THREAD_FUNNELED , &provisto);
+  double t_total = MPI_Wtime();
+  tiempos_iniciar();
+
   int size;
   MPI_Comm_size(MPI_COMM_WORLD , &size);
 
-  int m,n;
-  m = M/(size/2);
-  n = N/(size/2);
-
-  // Creación del comunicador cartesiano
-  int dims[2] = {0,0};
-  MPI_Dims_create( size , 2 , dims);
+  // Creación del comunicador cartesiano, con la malla de procesos de --decomp
+  int dims[2];
+  int entre_nodos;
+  double coste = elegir_descomposicion(desc,N,M,size,MPI_COMM_WORLD,dims,&entre_nodos);
   int periods[2] = {0,0};
-  int reorder = 1;
+  int reorder = (orden == REORDEN_MPI);
+
+  /* Con --reorder=node (por defecto) los procesos se permutan para que cada nodo
+     ocupe una tesela de la malla y el comunicador cartesiano se crea sobre la
+     permutación sin dejar que MPI los reordene */
+  MPI_Comm comm_cart, comm_perm = MPI_COMM_WORLD;
+  int tesela[2], nnodos = 1;
+  if (orden == REORDEN_NODOS) nnodos = reordenar_por_nodos(MPI_COMM_WORLD,N,M,dims,tesela,&comm_perm);
+  MPI_Cart_create( comm_perm , 2 , dims , periods , reorder , &comm_cart);
+  if (comm_perm != MPI_COMM_WORLD) MPI_Comm_free(&comm_perm);
+
+  int rank;
+  MPI_Comm_rank(comm_cart, &rank);
+
+  if (nnodos > 1 && !rank && !op.bench) {
+    if (tesela[0]) printf("Reordenación: %d nodos, teselas de %dx%d procesos (filas x columnas)\n",
+                          nnodos, tesela[1], tesela[0]);
+    else printf("Reordenación: %d nodos con distinto número de procesos, ordenados por nodo\n", nnodos);
+  }
+
+  if (N < dims[1] || M < dims[0]) {
+    if (!rank) fprintf(stderr, "La malla %dx%d es demasiado pequeña para %dx%d procesos\n", N, M, dims[1], dims[0]);
+    MPI_Comm_free(&comm_cart);
+    MPI_Finalize();
+    return 1;
+  }
+
+  /* multigrid y gradiente conjugado intercambian el halo con halo_intercambio: otro
+     modo no se aplicaría y la medida sería engañosa */
+  if (op.metodo != METODO_JACOBI && op.metodo != METODO_SOR && op.halo != HALO_BLOQUEANTE) {
+    if (!rank) fprintf(stderr, "--halo solo se aplica a Jacobi y SOR; use --halo=blocking con este método\n");
+    MPI_Comm_free(&comm_cart);
+    MPI_Finalize();
+    return 1;
+  }
+
+  /* con una sola fila o columna no hay malla más gruesa y el multigrid no tendría sentido */
+  if ((op.metodo == METODO_MG_V || op.metodo == METODO_MG_F) && (N < 2 || M < 2)) {
+    if (!rank) fprintf(stderr, "El multigrid necesita una malla de al menos 2x2 puntos\n");
+    MPI_Comm_free(&comm_cart);
+    MPI_Finalize();
+    return 1;
+  }
+
+  /* con --bench la salida es solo el registro de tiempos: los avisos van a stderr */
+  if (desc == DESC_AUTO && !rank && !op.bench)
+    printf("Descomposición: %dx%d procesos (filas x columnas), halo estimado en %g us por iteración "
+           "(red calibrada %s)\n", dims[1], dims[0], coste*1e6,
+           (size == 1) ? "sin comunicación" : entre_nodos ? "entre nodos" : "dentro de un nodo");
+
+#ifdef _OPENMP
+  if (!rank) {
+    if (!op.bench) printf("Procesos MPI: %d, hilos OpenMP por proceso: %d\n", size, omp_get_max_threads());
+    if (provisto < MPI_THREAD_FUNNELED) fprintf(stderr, "Aviso: MPI no garantiza MPI_THREAD_FUNNELED\n");
+  }
+#endif
 
-  MPI_Comm comm_cart;
-  MPI_Cart_create( MPI_COMM_WORLD , 2 , dims , periods , reorder , &comm_cart);
+  /* Bloque local: el resto de filas y columnas se reparte entre los primeros procesos */
+  int n, m, fila0, col0;
+  bloque_global(&comm_cart,N,M,&n,&m,&fila0,&col0);
 
+  if (op.metodo == METODO_SOR) {
+    if (op.omega <= 0.0) op.omega = sor_omega_optimo(N,M);
+    if (!rank && !op.bench) printf("SOR rojo-negro con omega = %g\n", op.omega);
+  }
 
   ld = m+2;  /* leading dimension */
 
   /* Reserva de memoria */
-  x = (double*)calloc((n+2)*(m+2),sizeof(double));
-  b = (double*)calloc((n+2)*(m+2),sizeof(double));
+  x = malla_reservar(n,ld);
+  b = malla_reservar(n,ld);
 
-  /* Inicializar datos */
+  /* Inicializar datos (con el mismo reparto de filas entre hilos que los núcleos) */
+  OMP(parallel for private(j) schedule(static))
   for (i=1; i<=n; i++) {
     for (j=1; j<=m; j++) {
       b[i*ld+j] = h*h*f;  /* suponemos que la función f es constante en todo el dominio */
@@ -178,78 +1978,62 @@ int main(int argc, char **argv)
   }
 
   /* Resolución del sistema por el método de Jacobi */
-  jacobi_poisson(n,m,x,b,&comm_cart);
+  int iteraciones = jacobi_poisson(N,M,x,b,&comm_cart,&op);
+  FASE(FASE_FUERA);
 
+  /* Con --output=fichero cada proceso escribe su bloque en un fichero binario con
+     MPI-IO (ver poisson_io.h), sin reunir la malla en el máster */
+  if (salida) {
+    CRONO(FASE_RECOGIDA, escribir_solucion(salida,comm_cart,N,M,n,m,fila0-1,col0-1,x));
+    if (op.bench) tiempos_informe(comm_cart,op.bench,variante,N,M,iteraciones,MPI_Wtime()-t_total);
+    if (resumen) tiempos_resumen(comm_cart);
+    malla_liberar(x);
+    malla_liberar(b);
+    MPI_Comm_free(&comm_cart);
+    MPI_Finalize();
+    return 0;
+  }
 
-  /* Recogida de la solución en máster */
-  int rank;
-  MPI_Comm_rank(comm_cart, &rank);
-  int my_coords[2];
-  MPI_Cart_coords(comm_cart, rank, 2, my_coords);
-  //printf("[MPI process %d] I am located at (%d, %d).\n", rank, my_coords[0],my_coords[1]);
 
-  // Creamos tipo de dato bloque entero
+  /* Recogida de la solución en máster: cada proceso envía su bloque interior y el
+     máster lo recibe directamente en su posición de la malla global con un subarray */
+  int tam[2], sub[2], ini[2];
   MPI_Datatype bloque, bloque_sol;
-  MPI_Type_vector(n,m,ld,MPI_DOUBLE,&bloque);
-  MPI_Type_commit(&bloque);
-  MPI_Type_vector(n,m,M,MPI_DOUBLE,&bloque_sol);
-  MPI_Type_commit(&bloque_sol);
-
-  sol = (double*)calloc(N*M,sizeof(double));
-
-//  for (i=1; i<=n; i++) {
-//     for (j=1; j<=m; j++) {
-//       printf("[MPI process %d]: %f\n",rank,x[i*ld+j]);
-//     }
-//   }
-  MPI_Cart_rank(comm_cart, my_coords, &rank);
-
-  int rank_cart;
-  int coods_cart[2];
-  /* Comunicación punto a punto */
-  if (!rank){
-    for (int i = 0; i<dims[0]; i++){
-      for (int j = 0; j<dims[1]; j++){
-        // Para la coordenada (0,0), es decirm rank = 0
-        if (i == 0 && j == 0){
-          for (int k=1; k<=n; k++){
-            for (int p=1; p<=m; p++){
-              sol[(k-1)*M+p-1] = x[k*ld+p];
-            }
-          }
-        }
-        else{
-          coods_cart[0] = i;
-          coods_cart[1] = j;
-          MPI_Cart_rank(comm_cart, coods_cart, &rank_cart);
-          MPI_Recv(&sol[j*n*M + i*m],1,bloque_sol,rank_cart,0,comm_cart,MPI_STATUS_IGNORE);
-        }
+  MPI_Request req;
 
-      }
-    }
-  }
-  else{
-    MPI_Send(&x[1*ld+1],1,bloque,0,0,comm_cart);
-  }
-  /* El problema de este envío es que la matriz se reconstruye del reves, hay que cambiar las
-     filas de arriba por las filas de abajo */
-  ld = M;
-  double *temp = (double*)calloc(M,sizeof(double));
+  tam[0] = n+2; tam[1] = m+2;
+  sub[0] = n;   sub[1] = m;
+  ini[0] = 1;   ini[1] = 1;
+  FASE(FASE_RECOGIDA);
+  MPI_Type_create_subarray(2, tam, sub, ini, MPI_ORDER_C, MPI_DOUBLE, &bloque);
+  MPI_Type_commit(&bloque);
+  MPI_Isend(x, 1, bloque, 0, 0, comm_cart, &req);
 
+  sol = NULL;
   if (!rank){
-    for (int i = 0, k = N-1; i<N/2; i++){
-      for (j = 0; j<M; j++){
-        temp[j] = sol[i*ld + j];
-        sol[i*ld + j] = sol[k*ld + j];
-        sol[k*ld + j] = temp[j];
-      }
-      k--;
+    int r, nr, mr, fr, cr, coords[2];
+    sol = (double*)calloc(N*M,sizeof(double));
+    tam[0] = N; tam[1] = M;
+    for (r = 0; r < size; r++){
+      MPI_Cart_coords(comm_cart, r, 2, coords);
+      bloque_coords(dims, coords, N, M, &nr, &mr, &fr, &cr);
+      sub[0] = nr;   sub[1] = mr;
+      ini[0] = fr-1; ini[1] = cr-1;
+      MPI_Type_create_subarray(2, tam, sub, ini, MPI_ORDER_C, MPI_DOUBLE, &bloque_sol);
+      MPI_Type_commit(&bloque_sol);
+      MPI_Recv(sol, 1, bloque_sol, r, 0, comm_cart, MPI_STATUS_IGNORE);
+      MPI_Type_free(&bloque_sol);
     }
   }
+  MPI_Wait(&req, MPI_STATUS_IGNORE);
+  FASE(FASE_FUERA);
 
+  ld = M;
 
-  /* Imprimir solución (solo para comprobación, eliminar en el caso de problemas grandes) */
-  if (!rank){
+  /* Imprimir solución (solo para comprobación, eliminar en el caso de problemas grandes);
+     con --bench solo el registro de tiempos */
+  if (op.bench) tiempos_informe(comm_cart,op.bench,variante,N,M,iteraciones,MPI_Wtime()-t_total);
+  else if (!rank){
     for (i=0; i<N; i++) {
       for (j=0; j<M; j++) {
         printf("%g ", sol[i*ld+j]);
@@ -257,14 +2041,14 @@ int main(int argc, char **argv)
       printf("\n");
     }
   }
- 
+  if (resumen) tiempos_resumen(comm_cart);
+
 
   MPI_Type_free(&bloque);
-  MPI_Type_free(&bloque_sol);
-  free(x);
-  free(b);
+  malla_liberar(x);
+  malla_liberar(b);
   free(sol);
-  free(temp);
+  MPI_Comm_free(&comm_cart);
 
   MPI_Finalize();
   return 0;